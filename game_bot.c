@@ -0,0 +1,442 @@
+#include "sock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+#define DEFAULT_BOTS 10
+#define DEFAULT_DURATION_S 30
+#define DEFAULT_INPUT_INTERVAL_MS 200
+#define MAX_EVENTS 256
+// Inputs are due at most this late.
+#define POLL_INTERVAL_MS 10
+// Input-to-echo latencies are counted in 1 ms buckets; slower echoes land
+// in the last one.
+#define LATENCY_BUCKETS 1000
+// Send times are remembered for this many unechoed moves.
+#define MOVE_WINDOW 64
+// Script letters: WASD move one step, IJKL shoot up, left, down, right.
+#define SCRIPT_LETTERS "WASDIJKL"
+
+// One simulated player. The protocol state is reset on every reconnect;
+// the statistics carry over.
+typedef struct {
+    int socket;
+    int index;
+    int closed;  // the server dropped the connection; the bot is finished
+    int dead;    // GAME_OVER arrived; reconnect once the read is done
+    Handshake world;          // id is 0 until the handshake arrives
+    int max_entities;
+    FrameBuffer frames;       // TCP
+    DatagramChannel channel;  // UDP
+    StoredSnapshot history[SNAPSHOT_HISTORY];
+    EntityRecord* records;    // backing for history
+    unsigned int seed;
+    int script_pos;
+    long next_input_ms;
+    uint16_t move_seq;
+    uint16_t echoed_seq;
+    long sent_at_ms[MOVE_WINDOW];  // by seq % MOVE_WINDOW
+    long connected_ms;
+    int tiles_left;  // map tiles still to come, -1 before the handshake
+    long map_ms;     // connect to last map tile, the first time a map completes
+    long snapshots;
+    long bytes;
+    int deaths;
+    uint32_t latency[LATENCY_BUCKETS];
+} Bot;
+
+Bot* bots = NULL;
+int bot_count = DEFAULT_BOTS;
+int duration_s = DEFAULT_DURATION_S;
+int input_interval_ms = DEFAULT_INPUT_INTERVAL_MS;
+const char* script = NULL;  // random inputs if NULL
+const char* server_ip = NULL;
+int use_udp = 0;
+int epoll_fd = -1;
+uint8_t* datagram = NULL;
+volatile sig_atomic_t running = 1;
+
+void stop(int signal) {
+    (void)signal;
+    running = 0;
+}
+
+void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+// Commands must arrive, so over UDP they go on the reliable channel.
+int bot_send(Bot* bot, const char* command) {
+    if (use_udp) {
+        return channel_send(bot->socket, NULL, &bot->channel, command, strlen(command), 1);
+    }
+    return send_data(bot->socket, command);
+}
+
+void connect_bot(Bot* bot) {
+    free(bot->records);
+    bot->records = NULL;
+    bot->world.id = 0;
+    bot->frames.len = 0;
+    bot->frames.start = 0;
+    bot->dead = 0;
+    bot->connected_ms = clock_ms();
+    bot->tiles_left = -1;
+    // Moves sent on the last connection will never be echoed.
+    bot->echoed_seq = bot->move_seq;
+
+    if (use_udp) {
+        bot->socket = init_client_datagram_socket(server_ip, DEFAULT_PORT);
+        channel_init(&bot->channel);
+        bot_send(bot, DATAGRAM_CONNECT);
+    } else {
+        bot->socket = init_client_socket(server_ip, DEFAULT_PORT);
+    }
+
+    struct epoll_event event = {EPOLLIN, {.ptr = bot}};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, bot->socket, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
+}
+
+void disconnect_bot(Bot* bot) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, bot->socket, NULL);
+    if (use_udp) {
+        channel_disconnect(bot->socket, NULL);
+        channel_clear(&bot->channel);
+    }
+    close(bot->socket);
+}
+
+void send_input(Bot* bot, long now) {
+    char action;
+    if (script != NULL) {
+        action = script[bot->script_pos];
+        if (script[++bot->script_pos] == '\0') {
+            bot->script_pos = 0;
+        }
+    } else if (rand_r(&bot->seed) % 4 != 0) {
+        action = SCRIPT_LETTERS[rand_r(&bot->seed) % 4];
+    } else {
+        action = SCRIPT_LETTERS[4 + rand_r(&bot->seed) % 4];
+    }
+
+    char command[64];
+    const char* shot = strchr("IJKL", action);
+    if (shot != NULL) {
+        snprintf(command, sizeof(command), "ACTION:SHOOT:%c", "ULDR"[shot - "IJKL"]);
+    } else {
+        if (++bot->move_seq == 0) {
+            bot->move_seq = 1;  // 0 means untagged
+        }
+        bot->sent_at_ms[bot->move_seq % MOVE_WINDOW] = now;
+        snprintf(command, sizeof(command), "ACTION:MOVE:1:%c:%u", action, bot->move_seq);
+    }
+    if (bot_send(bot, command) < 0) {
+        fprintf(stderr, "Bot %d failed to send %s\n", bot->index, command);
+    }
+}
+
+// The bot's own record echoes the last MOVE the server applied; every move
+// up to it has now been seen to take effect.
+void record_echo(Bot* bot, uint16_t seq, long now) {
+    while ((int16_t)(seq - bot->echoed_seq) > 0) {
+        if (++bot->echoed_seq == 0) {
+            bot->echoed_seq = 1;
+        }
+        if ((uint16_t)(bot->move_seq - bot->echoed_seq) < MOVE_WINDOW) {
+            long latency = now - bot->sent_at_ms[bot->echoed_seq % MOVE_WINDOW];
+            bot->latency[latency < LATENCY_BUCKETS ? latency : LATENCY_BUCKETS - 1]++;
+        }
+    }
+}
+
+void handle_snapshot(Bot* bot, const SnapshotView* snapshot, long now) {
+    if (bot->records == NULL) {
+        return;
+    }
+    StoredSnapshot* stored = snapshot_store(bot->history, bot->max_entities, snapshot);
+    if (stored == NULL) {
+        return;
+    }
+    bot->snapshots++;
+
+    char ack[32];
+    snprintf(ack, sizeof(ack), "ACK:%u", snapshot->tick);
+    if (use_udp) {
+        channel_send(bot->socket, NULL, &bot->channel, ack, strlen(ack), 0);
+    } else {
+        send_data(bot->socket, ack);
+    }
+
+    // Players come first in the sorted list.
+    for (int i = 0; i < stored->count && stored->entities[i].kind == ENTITY_PLAYER; i++) {
+        if (stored->entities[i].id == bot->world.id) {
+            record_echo(bot, stored->entities[i].data, now);
+            break;
+        }
+    }
+}
+
+void handle_message(Bot* bot, const uint8_t* payload, int len, long now) {
+    SnapshotView snapshot;
+    if (len > 0 && payload[0] == SNAPSHOT_MAGIC) {
+        if (snapshot_decode(payload, len, &snapshot) == 0) {
+            handle_snapshot(bot, &snapshot, now);
+        }
+        return;
+    }
+    if (len >= MAP_TILE_SIZE && payload[0] == MAP_TILE_MAGIC) {
+        if (bot->tiles_left > 0 && --bot->tiles_left == 0 && bot->map_ms < 0) {
+            bot->map_ms = now - bot->connected_ms;
+        }
+        return;
+    }
+
+    Message message;
+    if (message_parse(payload, len, &message) < 0) {
+        return;
+    }
+
+    if (message.type == MESSAGE_ASSIGN_ID) {
+        Handshake handshake;
+        if (bot->records != NULL || handshake_parse(&message, &handshake) < 0) {
+            return;
+        }
+        bot->world = handshake;
+        bot->tiles_left = ((handshake.width + MAP_TILE_CELLS - 1) / MAP_TILE_CELLS) *
+                          ((handshake.height + MAP_TILE_CELLS - 1) / MAP_TILE_CELLS);
+        bot->max_entities = bot->world.max_players + bot->world.max_ghosts + bot->world.max_bullets;
+        bot->records = calloc((size_t)bot->max_entities * SNAPSHOT_HISTORY, sizeof(EntityRecord));
+        if (bot->records == NULL) {
+            perror("Snapshot history allocation failed");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < SNAPSHOT_HISTORY; i++) {
+            bot->history[i].tick = 0;
+            bot->history[i].count = 0;
+            bot->history[i].entities = bot->records + i * bot->max_entities;
+        }
+        int capacity = FRAME_HEADER_SIZE + snapshot_max_size(bot->max_entities);
+        if (capacity < FRAME_HEADER_SIZE + MAP_TILE_SIZE) {
+            capacity = FRAME_HEADER_SIZE + MAP_TILE_SIZE;
+        }
+        if (!use_udp && capacity > bot->frames.cap && frame_buffer_reserve(&bot->frames, capacity) < 0) {
+            perror("Frame buffer allocation failed");
+            exit(EXIT_FAILURE);
+        }
+    } else if (message.type == MESSAGE_GAME_OVER) {
+        bot->deaths++;
+        bot->dead = 1;
+    }
+}
+
+// Returns -1 once the server has closed the connection.
+int read_bot(Bot* bot, long now) {
+    if (use_udp) {
+        int len = receive_datagram(bot->socket, datagram, NULL);
+        if (len < 0) {
+            return 0;
+        }
+        bot->bytes += len;
+        const uint8_t* payload;
+        int payload_len;
+        int status = channel_receive(bot->socket, NULL, &bot->channel, datagram, len, &payload, &payload_len);
+        if (status > 0) {
+            handle_message(bot, payload, payload_len, now);
+        }
+        return status < 0 ? -1 : 0;
+    }
+
+    int bytes_received = receive_frames(bot->socket, &bot->frames);
+    const uint8_t* payload;
+    int len;
+    int status = 0;
+    if (bytes_received > 0) {
+        bot->bytes += bytes_received;
+    }
+    while (bytes_received > 0 && (status = next_frame(&bot->frames, &payload, &len)) > 0) {
+        handle_message(bot, payload, len, now);
+    }
+    return (bytes_received <= 0 || status < 0) ? -1 : 0;
+}
+
+int latency_percentile(const uint32_t* latency, double fraction) {
+    uint64_t total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        total += latency[i];
+    }
+    if (total == 0) {
+        return -1;
+    }
+    uint64_t target = (uint64_t)(total * fraction);
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += latency[i];
+        if (seen > target) {
+            return i;
+        }
+    }
+    return LATENCY_BUCKETS - 1;
+}
+
+void print_stats(const char* name, long snapshots, long bytes, int deaths, long map_ms, const uint32_t* latency,
+                 double seconds) {
+    printf("%-8s %9.1f %7d %7d %7d %12ld %7d %7ld\n", name, snapshots / seconds, latency_percentile(latency, 0.50),
+           latency_percentile(latency, 0.95), latency_percentile(latency, 0.99), bytes, deaths, map_ms);
+}
+
+// Percentiles are in milliseconds, -1 if no move was echoed; map_ms is
+// how long the whole map took to arrive, -1 if it never did. The total
+// line shows the mean snapshot rate per bot and the slowest map.
+void report(double seconds) {
+    static uint32_t total_latency[LATENCY_BUCKETS];
+    long total_snapshots = 0, total_bytes = 0;
+    long slowest_map_ms = 0;
+    int total_deaths = 0, closed = 0;
+
+    printf("%-8s %9s %7s %7s %7s %12s %7s %7s\n", "bot", "snaps/s", "p50_ms", "p95_ms", "p99_ms", "bytes", "deaths",
+           "map_ms");
+    for (int i = 0; i < bot_count; i++) {
+        Bot* bot = &bots[i];
+        char name[16];
+        snprintf(name, sizeof(name), "%d%s", i, bot->closed ? "*" : "");
+        print_stats(name, bot->snapshots, bot->bytes, bot->deaths, bot->map_ms, bot->latency, seconds);
+        if (slowest_map_ms >= 0 && (bot->map_ms < 0 || bot->map_ms > slowest_map_ms)) {
+            slowest_map_ms = bot->map_ms;
+        }
+        total_snapshots += bot->snapshots;
+        total_bytes += bot->bytes;
+        total_deaths += bot->deaths;
+        closed += bot->closed;
+        for (int j = 0; j < LATENCY_BUCKETS; j++) {
+            total_latency[j] += bot->latency[j];
+        }
+    }
+    print_stats("total", total_snapshots / bot_count, total_bytes, total_deaths, slowest_map_ms, total_latency,
+                seconds);
+    if (closed > 0) {
+        printf("* disconnected by the server\n");
+    }
+}
+
+void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-n bots] [-d duration_s] [-i input_interval_ms] [-s script] [-u] <server_ip>\n"
+                    "       script letters: WASD move one step, IJKL shoot up, left, down, right\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:d:i:s:u")) != -1) {
+        switch (opt) {
+            case 'n': bot_count = atoi(optarg); break;
+            case 'd': duration_s = atoi(optarg); break;
+            case 'i': input_interval_ms = atoi(optarg); break;
+            case 's': script = optarg; break;
+            case 'u': use_udp = 1; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1 || bot_count <= 0 || duration_s <= 0 || input_interval_ms <= 0 ||
+        (script != NULL && (script[0] == '\0' || script[strspn(script, SCRIPT_LETTERS)] != '\0'))) {
+        usage(argv[0]);
+        return 1;
+    }
+    server_ip = argv[optind];
+
+    raise_fd_limit();
+    signal(SIGINT, stop);
+    signal(SIGTERM, stop);
+
+    epoll_fd = epoll_create1(0);
+    bots = calloc(bot_count, sizeof(Bot));
+    datagram = malloc(DATAGRAM_MAX_SIZE);
+    if (epoll_fd < 0 || bots == NULL || datagram == NULL) {
+        perror("Bot setup failed");
+        return 1;
+    }
+
+    long start_ms = clock_ms();
+    unsigned int seed = (unsigned int)time(NULL);
+    for (int i = 0; i < bot_count; i++) {
+        Bot* bot = &bots[i];
+        bot->index = i;
+        bot->map_ms = -1;
+        bot->seed = seed + i;
+        // Spread the bots' inputs across the interval.
+        bot->next_input_ms = start_ms + rand_r(&bot->seed) % input_interval_ms;
+        if (!use_udp && frame_buffer_init(&bot->frames, BUFFER_SIZE) < 0) {
+            perror("Frame buffer allocation failed");
+            return 1;
+        }
+        connect_bot(bot);
+    }
+    printf("Started %d %s bots against %s, one input every %d ms for %d s\n", bot_count, use_udp ? "UDP" : "TCP",
+           server_ip, input_interval_ms, duration_s);
+
+    long end_ms = clock_ms() + duration_s * 1000L;
+    int live = bot_count;
+    struct epoll_event events[MAX_EVENTS];
+    while (running && live > 0 && clock_ms() < end_ms) {
+        int n = epoll_wait(epoll_fd, events, MAX_EVENTS, POLL_INTERVAL_MS);
+        long now = clock_ms();
+        for (int i = 0; i < n; i++) {
+            Bot* bot = events[i].data.ptr;
+            if (read_bot(bot, now) < 0) {
+                disconnect_bot(bot);
+                bot->closed = 1;
+                live--;
+            } else if (bot->dead) {
+                disconnect_bot(bot);
+                connect_bot(bot);
+            }
+        }
+
+        for (int i = 0; i < bot_count; i++) {
+            Bot* bot = &bots[i];
+            if (bot->closed) {
+                continue;
+            }
+            if (use_udp && channel_resend(bot->socket, NULL, &bot->channel) < 0) {
+                disconnect_bot(bot);
+                bot->closed = 1;
+                live--;
+                continue;
+            }
+            if (bot->world.id != 0 && now >= bot->next_input_ms) {
+                send_input(bot, now);
+                bot->next_input_ms += input_interval_ms;
+                if (bot->next_input_ms < now) {
+                    bot->next_input_ms = now + input_interval_ms;
+                }
+            }
+        }
+    }
+
+    double seconds = (clock_ms() - start_ms) / 1000.0;
+    report(seconds);
+
+    for (int i = 0; i < bot_count; i++) {
+        if (!bots[i].closed) {
+            disconnect_bot(&bots[i]);
+        }
+        free(bots[i].records);
+        frame_buffer_free(&bots[i].frames);
+    }
+    free(bots);
+    free(datagram);
+    close(epoll_fd);
+    return 0;
+}
@@ -4,58 +4,159 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <poll.h>
 #include "raylib.h"
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
-
-#define MAX_PLAYERS 4
-#define MAX_GHOSTS 10
-#define GRID_WIDTH 30
-#define GRID_HEIGHT 30
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define CLAMP(v,lo,hi) ((v) < (lo) ? (lo) : (v) > (hi) ? (hi) : (v))
+
+// Players beyond the fourth reuse the same four colours.
+#define PLAYER_SPRITES 4
+// The window shows this many cells; larger worlds scroll with the player.
+#define VIEW_WIDTH 30
+#define VIEW_HEIGHT 30
 #define CELL_SIZE 30
-
-#define CMD_MOVE "MOVE"
-#define CMD_ASSIGN_ID "ASSIGN_ID"
-#define CMD_GAME_STATE "GAME_STATE"
-#define CMD_SHOOT "SHOOT"
-#define CMD_GAME_OVER "GAME_OVER"
-
-#define BUFFER_SIZE 2048
-
+// The background and walls are baked into render textures of this many
+// cells square. A view touches at most 3x3 of them, so the cache always
+// holds every visible chunk.
+#define CHUNK_CELLS 16
+#define CHUNK_CACHE 16
+// The receiver logs the last TILE_LOG map tiles to arrive, so a snapshot
+// copies only those into the back copy. A copy further behind than that
+// is refreshed whole.
+#define TILE_LOG 1024
+// Sprites are SPRITE_SIZE pixels square and sit in one row of the atlas,
+// each inside a 1-pixel border copied from its edges so scaled sampling
+// never picks up a neighbour.
+#define SPRITE_SIZE 16
+#define ATLAS_SLOT (SPRITE_SIZE + 2)
+
+// Moves sent but not yet acknowledged by a snapshot; the oldest is
+// forgotten if the server falls this far behind.
+#define PENDING_MOVES 64
+
+
+// prev_x and prev_y hold the position in the snapshot before the latest,
+// or the latest position for entities that just appeared, so remote
+// entities can be drawn part way between the two.
 typedef struct {
     int id;
     int x;
     int y;
+    int prev_x;
+    int prev_y;
 } PlayerInfo;
 
 typedef struct {
     int x;
     int y;
+    int prev_x;
+    int prev_y;
     int active;
 } Ghost;
 
 typedef struct {
     int x;
     int y;
+    int prev_x;
+    int prev_y;
     int active;
     char direction;
 } Bullet;
 
-int grid[GRID_HEIGHT][GRID_WIDTH];
-PlayerInfo players_info[MAX_PLAYERS];
-Ghost ghosts[MAX_GHOSTS];
-Bullet bullets[MAX_PLAYERS];
-int local_id = -1;
-pthread_mutex_t game_mutex = PTHREAD_MUTEX_INITIALIZER;
-
-Color player_colors[MAX_PLAYERS] = {RED, GREEN, BLUE, YELLOW};
+typedef struct {
+    uint16_t seq;
+    int steps;
+    char direction;
+} PendingMove;
 
-bool game_over = false;  
+// Every generated sprite lives in one atlas texture, so runs of sprite
+// draws never switch textures and raylib batches them into one draw call.
+typedef enum {
+    SPRITE_BACKGROUND,
+    SPRITE_WALL,
+    SPRITE_GHOST,
+    SPRITE_BULLET,
+    SPRITE_PLAYER,  // PLAYER_SPRITES consecutive slots
+    SPRITE_COUNT = SPRITE_PLAYER + PLAYER_SPRITES
+} Sprite;
 
-Texture2D backgroundTile;
-Texture2D wallTile;
-Texture2D playerSprites[MAX_PLAYERS];
-Texture2D ghostSprite;
+typedef struct {
+    RenderTexture2D texture;
+    int chunk_x;
+    int chunk_y;
+    int version;        // its chunk_versions entry when baked, -1 if never baked
+    unsigned long used;  // frame it was last drawn in
+} MapChunk;
+
+// One fully decoded snapshot. The receive thread fills a back copy while
+// the render thread reads its front copy, and the two swap through a third
+// so neither ever waits for the other.
+typedef struct {
+    PlayerInfo* players;  // max_players, by id - 1
+    Ghost* ghosts;        // max_ghosts, by id
+    Bullet* bullets;      // max_bullets, by id
+    uint8_t* walls;       // map_bitmap_size() bytes, 1 bit per wall
+    int* chunk_versions;  // per render chunk, the walls_version it last changed at
+    int walls_version;    // the receiver's walls_version when walls was copied
+    EntityRecord local;   // the local player's record, valid if has_local
+    int has_local;
+    long received_ms;     // 0 until the first snapshot lands in this copy
+    long interval_ms;     // running average gap between snapshots
+} RenderState;
+
+// Set in middle_state when it holds a copy the renderer has not taken yet.
+#define STATE_FRESH 4
+
+// World storage is sized by the server's handshake and carved from one
+// allocation. The receive thread sets it up once and then publishes
+// world_storage; everything is NULL until then.
+int grid_width = 0;
+int grid_height = 0;
+int max_players = 0;
+int max_ghosts = 0;
+int max_bullets = 0;
+int max_entities = 0;
+int tile_columns = 0;
+int chunk_columns = 0;
+int chunk_rows = 0;
+uint8_t* world_storage = NULL;
+RenderState states[3];
+int middle_state = 1;  // index of the spare copy plus STATE_FRESH, atomic
+// Owned by the receive thread.
+uint8_t* walls = NULL;        // map_bitmap_size() bytes, every map tile received so far
+int* chunk_versions = NULL;  // per render chunk, the walls_version it last changed at
+int tile_log[TILE_LOG];      // tile indices by walls_version % TILE_LOG
+int walls_version = 0;       // the number of tiles received
+StoredSnapshot history[SNAPSHOT_HISTORY];
+EntityRecord* previous = NULL;  // max_entities, the last snapshot applied
+int previous_count = 0;
+long snapshot_at_ms = 0;
+long snapshot_interval_ms = 100;
+int back_state = 2;
+int frame_capacity = BUFFER_SIZE;
+// Owned by the render thread. predicted_x is -1 while the local player is
+// not in the front copy.
+int front_state = 0;
+PendingMove pending_moves[PENDING_MOVES];
+int pending_count = 0;
+uint16_t move_seq = 0;
+int predicted_x = -1;
+int predicted_y = -1;
+int local_id = -1;  // set before world_storage is published
+int use_udp = 0;
+DatagramChannel channel;  // UDP mode, guarded by send_mutex
+pthread_mutex_t send_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+Color player_colors[PLAYER_SPRITES] = {RED, GREEN, BLUE, YELLOW};
+
+bool game_over = false;  // atomic
+
+Texture2D atlas;
+Rectangle spriteRects[SPRITE_COUNT];
+MapChunk mapChunks[CHUNK_CACHE];
+unsigned long frameNumber = 0;
 
 typedef enum {
     STATE_START_SCREEN,
@@ -63,19 +164,17 @@ typedef enum {
     STATE_GAME_OVER
 } GameState;
 
-Texture2D CreatePixelArtTexture(int width, int height, Color* pixels) {
+Image CreatePixelArtImage(int width, int height, Color* pixels) {
     Image image = GenImageColor(width, height, BLANK);
     for(int y = 0; y < height; y++) {
         for(int x = 0; x < width; x++) {
             ImageDrawPixel(&image, x, y, pixels[y * width + x]);
         }
     }
-    Texture2D texture = LoadTextureFromImage(image);
-    UnloadImage(image);
-    return texture;
+    return image;
 }
 
-Texture2D CreateBackgroundTile() {
+Image CreateBackgroundTile() {
     const int size = 16; 
     Color pixels[size * size];
 
@@ -97,10 +196,10 @@ Texture2D CreateBackgroundTile() {
     pixels[size * (size-1)] = highlightColor;
     pixels[size * size - 1] = highlightColor;
 
-    return CreatePixelArtTexture(size, size, pixels);
+    return CreatePixelArtImage(size, size, pixels);
 }
 
-Texture2D CreateWallTile() {
+Image CreateWallTile() {
     const int size = 16;
     Color pixels[size * size];
 
@@ -123,10 +222,10 @@ Texture2D CreateWallTile() {
         }
     }
 
-    return CreatePixelArtTexture(size, size, pixels);
+    return CreatePixelArtImage(size, size, pixels);
 }
 
-Texture2D CreateBatSprite(int playerIndex) {
+Image CreateBatSprite(int playerIndex) {
     const int size = 16;
     Color pixels[size * size];
 
@@ -173,10 +272,10 @@ Texture2D CreateBatSprite(int playerIndex) {
         }
     }
 
-    return CreatePixelArtTexture(size, size, pixels);
+    return CreatePixelArtImage(size, size, pixels);
 }
 
-Texture2D CreateGhostSprite() {
+Image CreateGhostSprite() {
     const int size = 16;
     Color pixels[size * size];
 
@@ -211,10 +310,40 @@ Texture2D CreateGhostSprite() {
         }
     }
 
-    return CreatePixelArtTexture(size, size, pixels);
+    return CreatePixelArtImage(size, size, pixels);
+}
+
+Image CreateBulletSprite() {
+    const int size = 16;
+    Color pixels[size * size];
+
+    Color coreColor = WHITE;
+    Color edgeColor = (Color){200, 200, 220, 255};
+
+    for(int i = 0; i < size * size; i++) {
+        pixels[i] = BLANK;
+    }
+
+    for(int y = 0; y < size; y++) {
+        for(int x = 0; x < size; x++) {
+            int dx = 2 * x + 1 - size;
+            int dy = 2 * y + 1 - size;
+            int distance = dx * dx + dy * dy;
+
+            if(distance <= 8 * 8) {
+                pixels[y * size + x] = edgeColor;
+            }
+
+            if(distance <= 6 * 6) {
+                pixels[y * size + x] = coreColor;
+            }
+        }
+    }
+
+    return CreatePixelArtImage(size, size, pixels);
 }
 
-Texture2D CreatePlayerSprite(int playerIndex) {
+Image CreatePlayerSprite(int playerIndex) {
     const int size = 16;
     Color pixels[size * size];
 
@@ -291,132 +420,631 @@ Texture2D CreatePlayerSprite(int playerIndex) {
         }
     }
 
-    return CreatePixelArtTexture(size, size, pixels);
+    return CreatePixelArtImage(size, size, pixels);
+}
+
+static size_t align_size(size_t size) {
+    return (size + 15) & ~(size_t)15;
+}
+
+int allocate_world(int width, int height, int players, int ghost_cap, int bullet_cap) {
+    int entities = players + bullet_cap + ghost_cap;
+    size_t history_size = align_size(entities * sizeof(EntityRecord));
+    size_t walls_size = align_size(map_bitmap_size(width, height));
+    int chunk_count = ((width + CHUNK_CELLS - 1) / CHUNK_CELLS) * ((height + CHUNK_CELLS - 1) / CHUNK_CELLS);
+    size_t versions_size = align_size(chunk_count * sizeof(int));
+    size_t sizes[] = {
+        walls_size,
+        versions_size,
+        align_size(players * sizeof(PlayerInfo)),
+        align_size(ghost_cap * sizeof(Ghost)),
+        align_size(bullet_cap * sizeof(Bullet)),
+    };
+    size_t state_size = 0;
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        state_size += sizes[i];
+    }
+    size_t total = walls_size + versions_size + history_size * (SNAPSHOT_HISTORY + 1) + state_size * 3;
+
+    uint8_t* storage = calloc(1, total);
+    if (storage == NULL) {
+        return -1;
+    }
+
+    uint8_t* base = storage;
+    walls = storage;
+    storage += walls_size;
+    chunk_versions = (int*)storage;
+    storage += versions_size;
+    previous = (EntityRecord*)storage;
+    storage += history_size;
+    for (int i = 0; i < SNAPSHOT_HISTORY; i++) {
+        history[i].tick = 0;
+        history[i].count = 0;
+        history[i].entities = (EntityRecord*)storage;
+        storage += history_size;
+    }
+    for (int i = 0; i < 3; i++) {
+        states[i].walls = storage;
+        storage += sizes[0];
+        states[i].chunk_versions = (int*)storage;
+        storage += sizes[1];
+        states[i].players = (PlayerInfo*)storage;
+        storage += sizes[2];
+        states[i].ghosts = (Ghost*)storage;
+        storage += sizes[3];
+        states[i].bullets = (Bullet*)storage;
+        storage += sizes[4];
+    }
+    grid_width = width;
+    grid_height = height;
+    max_players = players;
+    max_ghosts = ghost_cap;
+    max_bullets = bullet_cap;
+    max_entities = entities;
+    tile_columns = (width + MAP_TILE_CELLS - 1) / MAP_TILE_CELLS;
+    chunk_columns = (width + CHUNK_CELLS - 1) / CHUNK_CELLS;
+    chunk_rows = (height + CHUNK_CELLS - 1) / CHUNK_CELLS;
+    walls_version = 0;
+    // The render thread starts reading the world once it sees this.
+    __atomic_store_n(&world_storage, base, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Mirrors world_apply_input(): a move walks cell by cell and stops at
+// the first wall or edge.
+void predict_move(const uint8_t* walls, int* x, int* y, int steps, char direction) {
+    int dx = 0, dy = 0;
+    switch (direction) {
+        case 'W': dy = -1; break;
+        case 'S': dy = 1; break;
+        case 'A': dx = -1; break;
+        case 'D': dx = 1; break;
+    }
+    for (int i = 0; i < steps && (dx != 0 || dy != 0); i++) {
+        int new_x = *x + dx, new_y = *y + dy;
+        if (new_x < 0 || new_x >= grid_width || new_y < 0 || new_y >= grid_height ||
+            map_wall(walls, grid_width, new_x, new_y)) {
+            break;
+        }
+        *x = new_x;
+        *y = new_y;
+    }
 }
 
-void initialize_grid() {
-    for (int y = 0; y < GRID_HEIGHT; y++) {
-        for (int x = 0; x < GRID_WIDTH; x++) {
-            grid[y][x] = 0;
+// Starts from the server's position for the local player, forgets the
+// moves it has applied (its record echoes the last seq) and replays the
+// rest. Runs on the render thread whenever it takes a new front copy.
+void reconcile_moves(const RenderState* state) {
+    predicted_x = -1;
+    if (!state->has_local) {
+        return;
+    }
+
+    int kept = 0;
+    for (int i = 0; i < pending_count; i++) {
+        if ((int16_t)(pending_moves[i].seq - state->local.data) > 0) {
+            pending_moves[kept++] = pending_moves[i];
         }
     }
+    pending_count = kept;
+
+    predicted_x = state->local.x;
+    predicted_y = state->local.y;
+    for (int i = 0; i < pending_count; i++) {
+        predict_move(state->walls, &predicted_x, &predicted_y, pending_moves[i].steps, pending_moves[i].direction);
+    }
+}
+
+// Swaps in the copy the receive thread published last, if there is one
+// newer than the front copy.
+RenderState* acquire_front_state() {
+    if (__atomic_load_n(&middle_state, __ATOMIC_ACQUIRE) & STATE_FRESH) {
+        front_state = __atomic_exchange_n(&middle_state, front_state, __ATOMIC_ACQ_REL) & ~STATE_FRESH;
+        reconcile_moves(&states[front_state]);
+    }
+    return &states[front_state];
+}
+
+// Points an entity's prev position at where it was in the last snapshot.
+static void set_previous(RenderState* state, const EntityRecord* record) {
+    switch (record->kind) {
+        case ENTITY_PLAYER:
+            if (record->id >= 1 && record->id <= max_players) {
+                state->players[record->id - 1].prev_x = record->x;
+                state->players[record->id - 1].prev_y = record->y;
+            }
+            break;
+        case ENTITY_BULLET:
+            if (record->id < max_bullets) {
+                state->bullets[record->id].prev_x = record->x;
+                state->bullets[record->id].prev_y = record->y;
+            }
+            break;
+        case ENTITY_GHOST:
+            if (record->id < max_ghosts) {
+                state->ghosts[record->id].prev_x = record->x;
+                state->ghosts[record->id].prev_y = record->y;
+            }
+            break;
+    }
 }
 
-void parse_game_state(char* data) {
-    pthread_mutex_lock(&game_mutex);
+// Copies one received tile into a render copy, along with the versions of
+// the render chunks it overlaps. The end bytes of each row may carry cells
+// of the neighbouring tiles, which are just as current.
+void copy_tile(RenderState* state, int tile) {
+    int first_x = tile % tile_columns * MAP_TILE_CELLS;
+    int first_y = tile / tile_columns * MAP_TILE_CELLS;
+    int last_x = MIN(grid_width, first_x + MAP_TILE_CELLS);
+    int last_y = MIN(grid_height, first_y + MAP_TILE_CELLS);
+    for (int y = first_y; y < last_y; y++) {
+        long first = ((long)y * grid_width + first_x) >> 3;
+        long last = ((long)y * grid_width + last_x - 1) >> 3;
+        memcpy(state->walls + first, walls + first, last - first + 1);
+    }
+    for (int cy = first_y / CHUNK_CELLS; cy <= (last_y - 1) / CHUNK_CELLS; cy++) {
+        for (int cx = first_x / CHUNK_CELLS; cx <= (last_x - 1) / CHUNK_CELLS; cx++) {
+            state->chunk_versions[cy * chunk_columns + cx] = chunk_versions[cy * chunk_columns + cx];
+        }
+    }
+}
 
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        players_info[i].id = 0;
-        players_info[i].x = 0;
-        players_info[i].y = 0;
-        bullets[i].active = 0;
+// Decodes into the back copy, which nothing else touches, then swaps it
+// into the middle for the render thread to pick up.
+void apply_snapshot(const StoredSnapshot* entities) {
+    long now = clock_ms();
+    if (snapshot_at_ms != 0) {
+        snapshot_interval_ms = (snapshot_interval_ms * 7 + CLAMP(now - snapshot_at_ms, 1, 1000)) / 8;
+    }
+    snapshot_at_ms = now;
+
+    RenderState* state = &states[back_state];
+    state->received_ms = snapshot_at_ms;
+    state->interval_ms = snapshot_interval_ms;
+    state->has_local = 0;
+    if (walls_version - state->walls_version > TILE_LOG) {
+        memcpy(state->walls, walls, map_bitmap_size(grid_width, grid_height));
+        memcpy(state->chunk_versions, chunk_versions, (size_t)chunk_columns * chunk_rows * sizeof(int));
+    } else {
+        for (int version = state->walls_version; version < walls_version; version++) {
+            copy_tile(state, tile_log[version % TILE_LOG]);
+        }
     }
+    state->walls_version = walls_version;
 
-    for (int i = 0; i < MAX_GHOSTS; i++) {
-        ghosts[i].active = 0;
+    // -1 marks entities absent from the last snapshot; they start where
+    // they first appear.
+    for (int i = 0; i < max_players; i++) {
+        state->players[i].id = 0;
+        state->players[i].prev_x = -1;
+    }
+    for (int i = 0; i < max_bullets; i++) {
+        state->bullets[i].active = 0;
+        state->bullets[i].prev_x = -1;
+    }
+    for (int i = 0; i < max_ghosts; i++) {
+        state->ghosts[i].active = 0;
+        state->ghosts[i].prev_x = -1;
+    }
+    for (int i = 0; i < previous_count; i++) {
+        set_previous(state, &previous[i]);
     }
 
-    char* token = strtok(data, ";");
-    while (token != NULL) {
-        if (strncmp(token, "PLAYER:", 7) == 0) {
-            int id, x, y;
-            sscanf(token, "PLAYER:%d:%d:%d", &id, &x, &y);
-            for (int i = 0; i < MAX_PLAYERS; i++) {
-                if (players_info[i].id == 0) {
-                    players_info[i].id = id;
-                    players_info[i].x = x;
-                    players_info[i].y = y;
-                    break;
+    for (int i = 0; i < entities->count; i++) {
+        const EntityRecord* record = &entities->entities[i];
+        if (record->x >= grid_width || record->y >= grid_height) {
+            continue;
+        }
+
+        switch (record->kind) {
+            case ENTITY_PLAYER:
+                if (record->id >= 1 && record->id <= max_players) {
+                    PlayerInfo* player = &state->players[record->id - 1];
+                    player->id = record->id;
+                    player->x = record->x;
+                    player->y = record->y;
+                    if (player->prev_x < 0) {
+                        player->prev_x = player->x;
+                        player->prev_y = player->y;
+                    }
+                    if (record->id == local_id) {
+                        state->local = *record;
+                        state->has_local = 1;
+                    }
                 }
-            }
-        } else if (strncmp(token, "WALL:", 5) == 0) {
-            int x, y;
-            sscanf(token, "WALL:%d:%d", &x, &y);
-            grid[y][x] = 1;
-        } else if (strncmp(token, "BULLET:", 7) == 0) {
-            int id, x, y;
-            char direction;
-            sscanf(token, "BULLET:%d:%d:%d:%c", &id, &x, &y, &direction);
-            bullets[id].x = x;
-            bullets[id].y = y;
-            bullets[id].direction = direction;
-            bullets[id].active = 1;
-        } else if (strncmp(token, "GHOST:", 6) == 0) {
-            int x, y;
-            sscanf(token, "GHOST:%d:%d", &x, &y);
-            for (int i = 0; i < MAX_GHOSTS; i++) {
-                if (!ghosts[i].active) {
-                    ghosts[i].x = x;
-                    ghosts[i].y = y;
-                    ghosts[i].active = 1;
-                    break;
+                break;
+            case ENTITY_BULLET:
+                if (record->id < max_bullets) {
+                    Bullet* bullet = &state->bullets[record->id];
+                    bullet->x = record->x;
+                    bullet->y = record->y;
+                    bullet->direction = (char)record->dir;
+                    bullet->active = 1;
+                    if (bullet->prev_x < 0) {
+                        bullet->prev_x = bullet->x;
+                        bullet->prev_y = bullet->y;
+                    }
+                }
+                break;
+            case ENTITY_GHOST:
+                if (record->id < max_ghosts) {
+                    Ghost* ghost = &state->ghosts[record->id];
+                    ghost->x = record->x;
+                    ghost->y = record->y;
+                    ghost->active = 1;
+                    if (ghost->prev_x < 0) {
+                        ghost->prev_x = ghost->x;
+                        ghost->prev_y = ghost->y;
+                    }
+                }
+                break;
+        }
+    }
+
+    memcpy(previous, entities->entities, entities->count * sizeof(EntityRecord));
+    previous_count = entities->count;
+
+    back_state = __atomic_exchange_n(&middle_state, back_state | STATE_FRESH, __ATOMIC_ACQ_REL) & ~STATE_FRESH;
+}
+
+int receive_snapshot(const SnapshotView* snapshot) {
+    if (world_storage == NULL) {
+        return -1;
+    }
+
+    StoredSnapshot* stored = snapshot_store(history, max_entities, snapshot);
+    if (stored == NULL) {
+        return -1;
+    }
+    apply_snapshot(stored);
+    return 0;
+}
+
+// Commands must arrive, so over UDP they go on the reliable channel.
+void send_command(int socket, const char* command) {
+    pthread_mutex_lock(&send_mutex);
+    if (use_udp) {
+        if (channel_send(socket, NULL, &channel, command, strlen(command), 1) < 0) {
+            fprintf(stderr, "Too many commands in flight, dropped %s\n", command);
+        }
+    } else {
+        send_data(socket, command);
+    }
+    pthread_mutex_unlock(&send_mutex);
+}
+
+// Moves take effect locally at once and carry a seq so the snapshot that
+// reflects them can be recognised. Render thread only.
+void send_move(int socket, int steps, char direction) {
+    if (++move_seq == 0) {
+        move_seq = 1;  // 0 means untagged
+    }
+    if (pending_count == PENDING_MOVES) {
+        memmove(pending_moves, pending_moves + 1, (PENDING_MOVES - 1) * sizeof(PendingMove));
+        pending_count--;
+    }
+    pending_moves[pending_count++] = (PendingMove){move_seq, steps, direction};
+    if (predicted_x >= 0) {
+        predict_move(states[front_state].walls, &predicted_x, &predicted_y, steps, direction);
+    }
+
+    char command[64];
+    snprintf(command, sizeof(command), "ACTION:MOVE:%d:%c:%u", steps, direction, move_seq);
+    send_command(socket, command);
+}
+
+// Each ack supersedes the last, so a lost one needs no resend.
+void send_ack(int socket, uint32_t tick) {
+    char ack[32];
+    snprintf(ack, sizeof(ack), "ACK:%u", tick);
+    if (use_udp) {
+        pthread_mutex_lock(&send_mutex);
+        channel_send(socket, NULL, &channel, ack, strlen(ack), 0);
+        pthread_mutex_unlock(&send_mutex);
+    } else {
+        send_command(socket, ack);
+    }
+}
+
+void handle_message(int client_socket, const uint8_t* payload, int len) {
+    SnapshotView snapshot;
+    if (len > 0 && payload[0] == SNAPSHOT_MAGIC) {
+        if (snapshot_decode(payload, len, &snapshot) == 0 && receive_snapshot(&snapshot) == 0) {
+            send_ack(client_socket, snapshot.tick);
+        }
+        return;
+    }
+    // Tiles land in the receiver's bitmap and reach the render thread
+    // with the next snapshot, which re-bakes only the chunks they touch.
+    if (len > 0 && payload[0] == MAP_TILE_MAGIC) {
+        int tile_x, tile_y;
+        if (world_storage != NULL &&
+            map_tile_decode(payload, len, walls, grid_width, grid_height, &tile_x, &tile_y) == 0) {
+            tile_log[walls_version % TILE_LOG] = tile_y * tile_columns + tile_x;
+            walls_version++;
+            int first_x = tile_x * MAP_TILE_CELLS;
+            int first_y = tile_y * MAP_TILE_CELLS;
+            int last_x = MIN(grid_width, first_x + MAP_TILE_CELLS);
+            int last_y = MIN(grid_height, first_y + MAP_TILE_CELLS);
+            for (int cy = first_y / CHUNK_CELLS; cy <= (last_y - 1) / CHUNK_CELLS; cy++) {
+                for (int cx = first_x / CHUNK_CELLS; cx <= (last_x - 1) / CHUNK_CELLS; cx++) {
+                    chunk_versions[cy * chunk_columns + cx] = walls_version;
                 }
             }
         }
-        token = strtok(NULL, ";");
+        return;
+    }
+
+    Message message;
+    if (message_parse(payload, len, &message) < 0) {
+        return;
     }
 
-    pthread_mutex_unlock(&game_mutex);
+    if (message.type == MESSAGE_ASSIGN_ID) {
+        Handshake handshake;
+        if (handshake_parse(&message, &handshake) < 0) {
+            fprintf(stderr, "Malformed handshake: %.*s\n", len, (const char*)payload);
+            return;
+        }
+        if (world_storage != NULL) {
+            return;  // the world is sized once per connection
+        }
+        local_id = handshake.id;
+        if (allocate_world(handshake.width, handshake.height, handshake.max_players, handshake.max_ghosts,
+                           handshake.max_bullets) < 0) {
+            perror("World allocation failed");
+            return;
+        }
+        frame_capacity = FRAME_HEADER_SIZE + MAX(snapshot_max_size(max_entities), MAP_TILE_SIZE);
+        printf("Assigned ID: %d in a %dx%d world\n", local_id, grid_width, grid_height);
+    } else if (message.type == MESSAGE_GAME_OVER) {
+        printf("Game Over received.\n");
+        __atomic_store_n(&game_over, true, __ATOMIC_RELEASE);
+    }
 }
 
-void* receive_thread(void* arg) {
-    int client_socket = *((int*)arg);
+// UDP mode: waits at most RESEND_INTERVAL_MS for each datagram so
+// unacknowledged commands are resent on time.
+void receive_datagrams(int client_socket) {
+    uint8_t* datagram = malloc(DATAGRAM_MAX_SIZE);
+    if (datagram == NULL) {
+        perror("Datagram buffer allocation failed");
+        return;
+    }
 
-    char buffer[BUFFER_SIZE];
     while (1) {
-        int bytes_received = receive_data(client_socket, buffer, BUFFER_SIZE);
-        if (bytes_received <= 0) {
+        struct pollfd pfd = {client_socket, POLLIN, 0};
+        int ready = poll(&pfd, 1, RESEND_INTERVAL_MS);
+
+        pthread_mutex_lock(&send_mutex);
+        int status = channel_resend(client_socket, NULL, &channel);
+        pthread_mutex_unlock(&send_mutex);
+        if (status < 0) {
             printf("Disconnected from server.\n");
             break;
         }
+        if (ready <= 0) {
+            continue;
+        }
 
-        buffer[bytes_received] = '\0';
+        int len = receive_datagram(client_socket, datagram, NULL);
+        if (len < 0) {
+            continue;
+        }
+        const uint8_t* payload;
+        int payload_len;
+        pthread_mutex_lock(&send_mutex);
+        status = channel_receive(client_socket, NULL, &channel, datagram, len, &payload, &payload_len);
+        pthread_mutex_unlock(&send_mutex);
+        if (status < 0) {
+            printf("Disconnected from server.\n");
+            break;
+        }
+        if (status > 0) {
+            handle_message(client_socket, payload, payload_len);
+        }
+    }
+
+    free(datagram);
+}
 
-        if (strncmp(buffer, CMD_ASSIGN_ID, strlen(CMD_ASSIGN_ID)) == 0) {
-            sscanf(buffer, "ASSIGN_ID:%d", &local_id);
-            printf("Assigned ID: %d\n", local_id);
-        } else if (strncmp(buffer, CMD_GAME_STATE, strlen(CMD_GAME_STATE)) == 0) {
-            parse_game_state(buffer + strlen(CMD_GAME_STATE) + 1);
-        } else if (strncmp(buffer, CMD_GAME_OVER, strlen(CMD_GAME_OVER)) == 0) {
-            printf("Game Over received.\n");
-            game_over = true;
+void* receive_thread(void* arg) {
+    int client_socket = *((int*)arg);
+    if (use_udp) {
+        receive_datagrams(client_socket);
+        return NULL;
+    }
+
+    FrameBuffer frames;
+    if (frame_buffer_init(&frames, BUFFER_SIZE) < 0) {
+        perror("Frame buffer allocation failed");
+        return NULL;
+    }
+
+    while (1) {
+        int bytes_received = receive_frames(client_socket, &frames);
+        const uint8_t* payload;
+        int len;
+        int status = 0;
+
+        while (bytes_received > 0 && (status = next_frame(&frames, &payload, &len)) > 0) {
+            handle_message(client_socket, payload, len);
+            // The handshake tells us how large snapshots can get.
+            if (frame_capacity > frames.cap && frame_buffer_reserve(&frames, frame_capacity) < 0) {
+                perror("Frame buffer allocation failed");
+                status = -1;
+                break;
+            }
+        }
+
+        if (bytes_received <= 0 || status < 0) {
+            printf("Disconnected from server.\n");
+            break;
         }
     }
 
+    frame_buffer_free(&frames);
     return NULL;
 }
 
 void LoadGameTextures() {
-    backgroundTile = CreateBackgroundTile();
-    wallTile = CreateWallTile();
-    ghostSprite = CreateGhostSprite();
+    Image sprites[SPRITE_COUNT];
+    sprites[SPRITE_BACKGROUND] = CreateBackgroundTile();
+    sprites[SPRITE_WALL] = CreateWallTile();
+    sprites[SPRITE_GHOST] = CreateGhostSprite();
+    sprites[SPRITE_BULLET] = CreateBulletSprite();
+    for(int i = 0; i < PLAYER_SPRITES; i++) {
+        sprites[SPRITE_PLAYER + i] = CreatePlayerSprite(i);
+    }
+
+    // Drawing each sprite shifted by a pixel in every direction before the
+    // real copy fills its border with its own edge pixels.
+    const Vector2 shifts[] = {{-1, 0}, {1, 0}, {0, -1}, {0, 1}, {0, 0}};
+    Image atlasImage = GenImageColor(SPRITE_COUNT * ATLAS_SLOT, ATLAS_SLOT, BLANK);
+    for (int i = 0; i < SPRITE_COUNT; i++) {
+        Rectangle source = {0, 0, SPRITE_SIZE, SPRITE_SIZE};
+        spriteRects[i] = (Rectangle){i * ATLAS_SLOT + 1, 1, SPRITE_SIZE, SPRITE_SIZE};
+        for (size_t s = 0; s < sizeof(shifts) / sizeof(shifts[0]); s++) {
+            Rectangle target = spriteRects[i];
+            target.x += shifts[s].x;
+            target.y += shifts[s].y;
+            ImageDraw(&atlasImage, sprites[i], source, target, WHITE);
+        }
+        UnloadImage(sprites[i]);
+    }
+    atlas = LoadTextureFromImage(atlasImage);
+    UnloadImage(atlasImage);
 
-    for(int i = 0; i < MAX_PLAYERS; i++) {
-        playerSprites[i] = CreatePlayerSprite(i);
+    for (int i = 0; i < CHUNK_CACHE; i++) {
+        mapChunks[i].texture = LoadRenderTexture(CHUNK_CELLS * CELL_SIZE, CHUNK_CELLS * CELL_SIZE);
+        mapChunks[i].version = -1;
+        mapChunks[i].used = 0;
     }
 }
 
 void UnloadGameTextures() {
-    UnloadTexture(backgroundTile);
-    UnloadTexture(wallTile);
-    UnloadTexture(ghostSprite);
-    for(int i = 0; i < MAX_PLAYERS; i++) {
-        UnloadTexture(playerSprites[i]);
+    UnloadTexture(atlas);
+    for (int i = 0; i < CHUNK_CACHE; i++) {
+        UnloadRenderTexture(mapChunks[i].texture);
     }
 }
 
+// Draws one cell-sized sprite from the atlas.
+void DrawSprite(Sprite sprite, Vector2 position) {
+    DrawTexturePro(atlas, spriteRects[sprite], (Rectangle){position.x, position.y, CELL_SIZE, CELL_SIZE},
+                   (Vector2){0, 0}, 0.0f, WHITE);
+}
+
+void BakeMapChunk(const RenderState* state, MapChunk* chunk, int chunk_x, int chunk_y) {
+    int first_x = chunk_x * CHUNK_CELLS;
+    int first_y = chunk_y * CHUNK_CELLS;
+    int last_x = MIN(grid_width, first_x + CHUNK_CELLS);
+    int last_y = MIN(grid_height, first_y + CHUNK_CELLS);
+
+    BeginTextureMode(chunk->texture);
+    ClearBackground(BLANK);
+    for (int y = first_y; y < last_y; y++) {
+        for (int x = first_x; x < last_x; x++) {
+            Vector2 position = {(x - first_x) * CELL_SIZE, (y - first_y) * CELL_SIZE};
+            DrawSprite(SPRITE_BACKGROUND, position);
+            if (map_wall(state->walls, grid_width, x, y)) {
+                DrawSprite(SPRITE_WALL, position);
+            }
+        }
+    }
+    EndTextureMode();
+
+    chunk->chunk_x = chunk_x;
+    chunk->chunk_y = chunk_y;
+    chunk->version = state->chunk_versions[chunk_y * chunk_columns + chunk_x];
+}
+
+// Finds a chunk in the cache, baking it into the least recently drawn slot
+// if it is missing or out of date. Call outside BeginMode2D(), since
+// baking switches render targets.
+MapChunk* FetchMapChunk(const RenderState* state, int chunk_x, int chunk_y) {
+    MapChunk* chunk = NULL;
+    MapChunk* oldest = &mapChunks[0];
+    for (int i = 0; i < CHUNK_CACHE && chunk == NULL; i++) {
+        if (mapChunks[i].version >= 0 && mapChunks[i].chunk_x == chunk_x && mapChunks[i].chunk_y == chunk_y) {
+            chunk = &mapChunks[i];
+        } else if (mapChunks[i].used < oldest->used) {
+            oldest = &mapChunks[i];
+        }
+    }
+    if (chunk == NULL) {
+        chunk = oldest;
+    }
+    if (chunk->version != state->chunk_versions[chunk_y * chunk_columns + chunk_x] || chunk->chunk_x != chunk_x ||
+        chunk->chunk_y != chunk_y) {
+        BakeMapChunk(state, chunk, chunk_x, chunk_y);
+    }
+    chunk->used = frameNumber;
+    return chunk;
+}
+
+// Keeps the local player centred, stopping at the world edges. Worlds
+// smaller than the window are centred instead.
+Camera2D FollowCamera() {
+    Camera2D camera = {0};
+    camera.zoom = 1.0f;
+    camera.offset = (Vector2){VIEW_WIDTH * CELL_SIZE / 2.0f, VIEW_HEIGHT * CELL_SIZE / 2.0f};
+
+    float x = grid_width * CELL_SIZE / 2.0f;
+    float y = grid_height * CELL_SIZE / 2.0f;
+    if (predicted_x >= 0) {
+        x = predicted_x * CELL_SIZE + CELL_SIZE / 2.0f;
+        y = predicted_y * CELL_SIZE + CELL_SIZE / 2.0f;
+    }
+    if (grid_width > VIEW_WIDTH) {
+        x = CLAMP(x, camera.offset.x, grid_width * CELL_SIZE - camera.offset.x);
+    } else {
+        x = grid_width * CELL_SIZE / 2.0f;
+    }
+    if (grid_height > VIEW_HEIGHT) {
+        y = CLAMP(y, camera.offset.y, grid_height * CELL_SIZE - camera.offset.y);
+    } else {
+        y = grid_height * CELL_SIZE / 2.0f;
+    }
+    camera.target = (Vector2){x, y};
+    return camera;
+}
+
+// Pixel position of an entity a fraction t of the way from its cell in
+// the previous snapshot to its cell in the latest one.
+Vector2 InterpolateCell(int prev_x, int prev_y, int x, int y, float t) {
+    return (Vector2){(prev_x + (x - prev_x) * t) * CELL_SIZE, (prev_y + (y - prev_y) * t) * CELL_SIZE};
+}
+
 int main(int argc, char* argv[]) {
-    if (argc != 2) {
-        fprintf(stderr, "Usage: %s <server_ip>\n", argv[0]);
+    int opt;
+    while ((opt = getopt(argc, argv, "u")) != -1) {
+        switch (opt) {
+            case 'u': use_udp = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-u] <server_ip>\n", argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-u] <server_ip>\n", argv[0]);
         return 1;
     }
 
-    int client_socket = init_client_socket(argv[1], DEFAULT_PORT);
+    int client_socket;
+    if (use_udp) {
+        client_socket = init_client_datagram_socket(argv[optind], DEFAULT_PORT);
+        channel_init(&channel);
+        send_command(client_socket, DATAGRAM_CONNECT);
+    } else {
+        client_socket = init_client_socket(argv[optind], DEFAULT_PORT);
+    }
 
     pthread_t thread_id;
     pthread_create(&thread_id, NULL, receive_thread, &client_socket);
 
-    InitWindow(GRID_WIDTH * CELL_SIZE, GRID_HEIGHT * CELL_SIZE, "Game Client");
+    InitWindow(VIEW_WIDTH * CELL_SIZE, VIEW_HEIGHT * CELL_SIZE, "Game Client");
     LoadGameTextures();
 
     GameState gameState = STATE_START_SCREEN;
@@ -431,12 +1059,12 @@ int main(int argc, char* argv[]) {
                 const char* booText = "boo";
                 int booFontSize = 80;
                 int booTextWidth = MeasureText(booText, booFontSize);
-                DrawText(booText, (GRID_WIDTH * CELL_SIZE - booTextWidth) / 2, GRID_HEIGHT * CELL_SIZE / 3, booFontSize, WHITE);
+                DrawText(booText, (VIEW_WIDTH * CELL_SIZE - booTextWidth) / 2, VIEW_HEIGHT * CELL_SIZE / 3, booFontSize, WHITE);
 
                 const char* startText = "Press ENTER to Start";
                 int startFontSize = 20;
                 int startTextWidth = MeasureText(startText, startFontSize);
-                DrawText(startText, (GRID_WIDTH * CELL_SIZE - startTextWidth) / 2, GRID_HEIGHT * CELL_SIZE * 2 / 3, startFontSize, WHITE);
+                DrawText(startText, (VIEW_WIDTH * CELL_SIZE - startTextWidth) / 2, VIEW_HEIGHT * CELL_SIZE * 2 / 3, startFontSize, WHITE);
 
                 EndDrawing();
 
@@ -446,10 +1074,11 @@ int main(int argc, char* argv[]) {
                 break;
 
             case STATE_PLAYING:
-                if (!game_over) {
+                bool over = __atomic_load_n(&game_over, __ATOMIC_ACQUIRE);
+                if (!over) {
                     for (int i = KEY_ZERO; i <= KEY_NINE; i++) {
                         if (IsKeyPressed(i)) {
-                            steps = steps * 10 + (i - KEY_ZERO);
+                            steps = MIN(steps * 10 + (i - KEY_ZERO), MAX_MOVE_STEPS);
                         }
                     }
 
@@ -468,82 +1097,97 @@ int main(int argc, char* argv[]) {
 
                     if (direction != '\0') {
                         if (steps == 0) steps = 1;  
-                        snprintf(command, sizeof(command), "ACTION:MOVE:%d:%c", steps, direction);
-                        send_data(client_socket, command);
+                        send_move(client_socket, steps, direction);
                         steps = 0;  
                     }
 
                     if (IsKeyPressed(KEY_UP)) {
                         snprintf(command, sizeof(command), "ACTION:SHOOT:U");
-                        send_data(client_socket, command);
+                        send_command(client_socket, command);
                     } else if (IsKeyPressed(KEY_DOWN)) {
                         snprintf(command, sizeof(command), "ACTION:SHOOT:D");
-                        send_data(client_socket, command);
+                        send_command(client_socket, command);
                     } else if (IsKeyPressed(KEY_LEFT)) {
                         snprintf(command, sizeof(command), "ACTION:SHOOT:L");
-                        send_data(client_socket, command);
+                        send_command(client_socket, command);
                     } else if (IsKeyPressed(KEY_RIGHT)) {
                         snprintf(command, sizeof(command), "ACTION:SHOOT:R");
-                        send_data(client_socket, command);
+                        send_command(client_socket, command);
                     }
                 }
 
                 BeginDrawing();
                 ClearBackground(BLACK);
 
-                if (game_over) {
-                    DrawText("GAME OVER", GRID_WIDTH * CELL_SIZE / 2 - MeasureText("GAME OVER", 40) / 2, GRID_HEIGHT * CELL_SIZE / 2 - 20, 40, RED);
-                } else {
-                    pthread_mutex_lock(&game_mutex);
-
-                    for (int y = 0; y < GRID_HEIGHT; y++) {
-                        for (int x = 0; x < GRID_WIDTH; x++) {
-
-                            DrawTextureEx(backgroundTile, 
-                                (Vector2){x * CELL_SIZE, y * CELL_SIZE}, 
-                                0.0f, 
-                                CELL_SIZE/16.0f,  
-                                WHITE);
-
-                            if (grid[y][x] == 1) {
-                                DrawTextureEx(wallTile, 
-                                    (Vector2){x * CELL_SIZE, y * CELL_SIZE}, 
-                                    0.0f, 
-                                    CELL_SIZE/16.0f, 
-                                    WHITE);
-                            }
+                if (over) {
+                    DrawText("GAME OVER", VIEW_WIDTH * CELL_SIZE / 2 - MeasureText("GAME OVER", 40) / 2, VIEW_HEIGHT * CELL_SIZE / 2 - 20, 40, RED);
+                } else if (__atomic_load_n(&world_storage, __ATOMIC_ACQUIRE) != NULL &&
+                           acquire_front_state()->received_ms != 0) {
+                    const RenderState* state = &states[front_state];
+                    Camera2D camera = FollowCamera();
+                    frameNumber++;
+
+                    // Only the chunks inside the window are drawn, one quad
+                    // each; any that need baking are baked first.
+                    int first_x = (int)((camera.target.x - camera.offset.x) / CELL_SIZE);
+                    int first_y = (int)((camera.target.y - camera.offset.y) / CELL_SIZE);
+                    int last_x = MIN(grid_width, first_x + VIEW_WIDTH + 1);
+                    int last_y = MIN(grid_height, first_y + VIEW_HEIGHT + 1);
+                    if (first_x < 0) first_x = 0;
+                    if (first_y < 0) first_y = 0;
+
+                    MapChunk* visible[CHUNK_CACHE];
+                    int visible_count = 0;
+                    for (int cy = first_y / CHUNK_CELLS; cy <= (last_y - 1) / CHUNK_CELLS; cy++) {
+                        for (int cx = first_x / CHUNK_CELLS; cx <= (last_x - 1) / CHUNK_CELLS; cx++) {
+                            visible[visible_count++] = FetchMapChunk(state, cx, cy);
                         }
                     }
 
-                    for (int i = 0; i < MAX_PLAYERS; i++) {
-                        if (players_info[i].id != 0) {
-                            DrawTextureEx(playerSprites[players_info[i].id - 1],
-                                (Vector2){players_info[i].x * CELL_SIZE, players_info[i].y * CELL_SIZE},
-                                0.0f,
-                                CELL_SIZE/16.0f,
-                                WHITE);
+                    BeginMode2D(camera);
+
+                    // Render textures are stored upside down, hence the
+                    // negative source height.
+                    for (int i = 0; i < visible_count; i++) {
+                        Texture2D texture = visible[i]->texture.texture;
+                        DrawTextureRec(texture,
+                            (Rectangle){0, 0, texture.width, -texture.height},
+                            (Vector2){visible[i]->chunk_x * CHUNK_CELLS * CELL_SIZE, visible[i]->chunk_y * CHUNK_CELLS * CELL_SIZE},
+                            WHITE);
+                    }
+
+                    // Remote entities trail the latest snapshot by up to one
+                    // snapshot interval; the local player is drawn where its
+                    // own moves put it.
+                    float t = CLAMP((clock_ms() - state->received_ms) / (float)state->interval_ms, 0.0f, 1.0f);
+
+                    for (int i = 0; i < max_players; i++) {
+                        const PlayerInfo* player = &state->players[i];
+                        if (player->id != 0) {
+                            Vector2 position = player->id == local_id && predicted_x >= 0
+                                ? (Vector2){predicted_x * CELL_SIZE, predicted_y * CELL_SIZE}
+                                : InterpolateCell(player->prev_x, player->prev_y, player->x, player->y, t);
+                            DrawSprite(SPRITE_PLAYER + (player->id - 1) % PLAYER_SPRITES, position);
                         }
                     }
 
-                    for (int i = 0; i < MAX_PLAYERS; i++) {
-                        if (bullets[i].active) {
-                            DrawCircle(bullets[i].x * CELL_SIZE + CELL_SIZE / 2, 
-                                      bullets[i].y * CELL_SIZE + CELL_SIZE / 2, 
-                                      CELL_SIZE / 4, WHITE);
+                    for (int i = 0; i < max_bullets; i++) {
+                        const Bullet* bullet = &state->bullets[i];
+                        if (bullet->active) {
+                            DrawSprite(SPRITE_BULLET,
+                                InterpolateCell(bullet->prev_x, bullet->prev_y, bullet->x, bullet->y, t));
                         }
                     }
 
-                    for (int i = 0; i < MAX_GHOSTS; i++) {
-                        if (ghosts[i].active) {
-                            DrawTextureEx(ghostSprite,
-                                (Vector2){ghosts[i].x * CELL_SIZE, ghosts[i].y * CELL_SIZE},
-                                0.0f,
-                                CELL_SIZE/16.0f,
-                                WHITE);
+                    for (int i = 0; i < max_ghosts; i++) {
+                        const Ghost* ghost = &state->ghosts[i];
+                        if (ghost->active) {
+                            DrawSprite(SPRITE_GHOST,
+                                InterpolateCell(ghost->prev_x, ghost->prev_y, ghost->x, ghost->y, t));
                         }
                     }
 
-                    pthread_mutex_unlock(&game_mutex);
+                    EndMode2D();
                 }
 
                 EndDrawing();
@@ -557,6 +1201,9 @@ int main(int argc, char* argv[]) {
 
     UnloadGameTextures();
     CloseWindow();
+    if (use_udp) {
+        channel_disconnect(client_socket, NULL);
+    }
     close(client_socket);
     return 0;
 }
\ No newline at end of file
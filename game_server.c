@@ -1,347 +1,1651 @@
 #include "sock.h"
+#include "world.h"
+#include "kernels.h"
+#include "map.h"
+#include "profile.h"
+#include "replay.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <time.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 
-#define MAX_PLAYERS 4
-#define MAX_GHOSTS 10
-#define GRID_WIDTH 30
-#define GRID_HEIGHT 30
-#define BUFFER_SIZE 2048
+// Inputs a player may have waiting in its room's queue; the queue holds
+// this many per player, so one flooding client cannot crowd out the rest.
+#define PLAYER_INPUT_DEPTH 16
+#define DEFAULT_INPUTS_PER_TICK 4
+#define MAX_CATCHUP_TICKS 5
+#define MAX_EVENTS 64
+// Queued snapshots beyond this are collapsed to the newest one.
+#define OUT_QUEUE_COLLAPSE_DEPTH 8
+// Clients with more than this many unsent bytes (or OUT_QUEUE_MAX_SNAPSHOTS
+// worst-case snapshots, if larger) are disconnected.
+#define OUT_QUEUE_MAX_BYTES (256 * 1024)
+#define OUT_QUEUE_MAX_SNAPSHOTS 4
+#define DEFAULT_MAX_ROOMS 256
+// Map tiles go out a few per tick, and only while the connection has fewer
+// than MAP_TILE_BACKLOG frames queued or reliable datagrams unacknowledged.
+// Tiles within MAP_NEAR_RING of the player's tile jump the queue.
+#define MAP_TILES_PER_TICK 32
+#define MAP_TILE_BACKLOG 48
+#define MAP_NEAR_RING 1
+// UDP peers are found by address in a per-reactor hash table.
+#define PEER_BUCKETS 1024
+// A UDP peer that sends nothing for this long is dropped.
+#define PEER_TIMEOUT_MS 5000
 
+typedef struct Connection Connection;
+typedef struct Reactor Reactor;
+typedef struct Room Room;
+
+struct Connection {
+    int socket;
+    Room* room;              // fixed for the life of the connection
+    int player_slot;
+    FrameBuffer frames;
+    Reactor* reactor;
+    pthread_mutex_t out_mutex;
+    OutQueue out;            // guarded by out_mutex
+    int overflowed;          // guarded by out_mutex
+    int reliable_in_flight;  // guarded by out_mutex, as of the last flush
+    int dirty;               // guarded by reactor->dirty_mutex
+    Connection* next_dirty;  // guarded by reactor->dirty_mutex
+    int want_write;          // owned by the reactor thread
+    int closing;             // owned by the reactor thread, set by close_connection()
+    Connection* next_closed;  // owned by the reactor thread
+    // UDP mode only, all owned by the reactor thread.
+    struct sockaddr_in peer;
+    DatagramChannel channel;
+    long last_heard_ms;
+    Connection* next_peer;
+    uint32_t session;  // join_room() call that placed it, stamped on its inputs
+    // Written by the reactor thread, read by the stats thread.
+    unsigned long messages_sent;
+    unsigned long bytes_sent;
+};
+
+struct Reactor {
+    int epoll_fd;
+    int event_fd;
+    pthread_mutex_t dirty_mutex;
+    Connection* dirty;  // connections with frames queued since the last flush
+    Connection* closed;  // closed during this batch of events, freed after it
+    // UDP mode only: this reactor's socket on the shared port, a receive
+    // buffer and the peers whose datagrams arrive on it.
+    int datagram_socket;
+    uint8_t* datagram;
+    Connection** peers;  // PEER_BUCKETS chains
+    long service_at_ms;
+};
+
+typedef struct {
+    Input input;
+    uint32_t arrival_tick;  // room tick when the input was read
+    uint32_t session;       // the sender's Connection session
+} QueuedInput;
+
+// One slot of a room's input ring. sequence is the ring position plus one
+// once the item is written, and the position plus the capacity once the
+// consumer has read it and the slot is free for the next lap.
 typedef struct {
+    uint32_t sequence;
+    QueuedInput item;
+} InputCell;
+
+typedef struct {
+    Connection* connection;
+    uint32_t session;
+    uint32_t acked_tick;
+    // Where the client's view was centred for each recent tick, so a
+    // filtered baseline can be rebuilt from the world history.
+    uint32_t view_tick[SNAPSHOT_HISTORY];
+    uint16_t view_x[SNAPSHOT_HISTORY];
+    uint16_t view_y[SNAPSHOT_HISTORY];
+    // Map streaming: tiles not yet sent, and where the ring walk around
+    // the tile the player joined in has got to.
+    int tiles_left;
+    int tile_center_x;
+    int tile_center_y;
+    int tile_ring;
+    int tile_step;
+} RoomClient;
+
+// One match. The matchmaker owns active and client_count (under
+// rooms_mutex); everything else belongs to whichever worker steps the room.
+// Storage is allocated the first time the room opens and reused after.
+struct Room {
     int id;
-    int socket;
-    int x;
-    int y;
-    int active;
-    time_t start_time;
-} Player;
+    int active;        // written under rooms_mutex and mutex
+    int client_count;  // guarded by rooms_mutex
+    pthread_mutex_t mutex;
+    World world;            // guarded by mutex
+    Recorder recorder;      // guarded by mutex, open while recording
+    RoomClient* clients;    // max_players, guarded by mutex
+    OutBuffer** states;     // max_players, scratch for broadcast_room()
+    uint32_t* state_bases;
+    uint8_t* encoded;             // snapshot_capacity bytes, scratch
+    EntityRecord* visible;        // max_entities, scratch for filtering
+    EntityRecord* visible_base;   // max_entities, scratch for filtering
+    // Inputs go through a bounded lock-free ring: any reactor pushes, and
+    // whichever worker steps the room pops under mutex. It is never reset;
+    // inputs left by departed players are skipped by session.
+    InputCell* inputs;        // input_capacity cells
+    uint32_t input_capacity;  // a power of two
+    uint32_t input_head;      // next position to claim, atomic
+    uint32_t input_tail;      // next position to read, consumer only
+    uint32_t input_tick;      // world.tick for arrival stamps, atomic
+    int* queued;              // max_players, inputs each slot has in the ring, atomic
+    uint32_t* limit_tick;     // max_players, consumer only: arrival tick being counted
+    int* limit_count;         // max_players, consumer only: inputs applied from it
+    OutBuffer** tiles;        // tile_count, encoded on first use; shared_tiles with a map
+    uint8_t* tiles_sent;      // tile_set_size bytes per slot, guarded by mutex
+};
 
+// Rooms due this tick, split across the workers. The owner pops from the
+// tail; idle workers steal from the head.
 typedef struct {
-    int x;
-    int y;
-    int active;
-} Ghost;
+    pthread_mutex_t mutex;
+    Room** rooms;
+    int head;
+    int tail;
+} WorkDeque;
 
 typedef struct {
-    int x;
-    int y;
-    int active;
-    char direction;
-} Bullet;
+    unsigned long ticks;
+    unsigned long overruns;
+    unsigned long skipped;
+    long worst_lag_ns;
+} TickStats;
 
-Player players[MAX_PLAYERS];
-Ghost ghosts[MAX_GHOSTS];
-Bullet bullets[MAX_PLAYERS];
-int grid[GRID_HEIGHT][GRID_WIDTH];
-pthread_mutex_t game_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Phases timed by the profiler. Input (drain and apply), bullets, ghosts
+// and serialize (record, encode and queue) are timed per room, send per
+// flush of one connection and tick for the whole tick across every room.
+typedef enum {
+    PHASE_INPUT,
+    PHASE_BULLETS,
+    PHASE_GHOSTS,
+    PHASE_SERIALIZE,
+    PHASE_SEND,
+    PHASE_TICK,
+    PHASE_COUNT
+} Phase;
 
-void initialize_grid() {
-    for (int y = 0; y < GRID_HEIGHT; y++) {
-        for (int x = 0; x < GRID_WIDTH; x++) {
-            grid[y][x] = 0;
+typedef struct {
+    unsigned long frames_queued;
+    unsigned long snapshots_dropped;
+    unsigned long slow_disconnects;
+    int max_queue_depth;
+} OutboundStats;
+
+int server_socket;
+int udp_mode = 0;
+Reactor* reactors;
+int io_threads = 1;
+int worker_threads = 0;
+int tick_rate = 10;
+int ghost_interval = 5;
+WorldConfig world_config = {DEFAULT_GRID_WIDTH, DEFAULT_GRID_HEIGHT, DEFAULT_MAX_PLAYERS, DEFAULT_MAX_GHOSTS,
+                            DEFAULT_BULLETS_PER_PLAYER, DEFAULT_FIRE_COOLDOWN, NULL};
+int snapshot_capacity;
+int tiles_across;
+int tiles_down;
+int tile_count;
+int tile_set_size;  // bytes of one client's tiles_sent bitmap
+int view_radius = 0;  // cells; 0 sends every client the whole world
+int out_queue_limit = OUT_QUEUE_MAX_BYTES;
+TickStats tick_stats;
+OutboundStats outbound_stats;
+unsigned long inputs_dropped = 0;
+unsigned long inputs_limited = 0;
+int inputs_per_tick = DEFAULT_INPUTS_PER_TICK;  // per player, by arrival tick
+uint32_t join_sessions = 0;  // guarded by rooms_mutex
+const char* phase_names[PHASE_COUNT] = {"input", "bullets", "ghosts", "serialize", "send", "tick"};
+Histogram phase_histograms[PHASE_COUNT];
+// Entities across every room, summed by the workers during a tick and
+// published by the simulation thread once it ends.
+int tick_entities[ENTITY_KIND_COUNT];
+int entity_counts[ENTITY_KIND_COUNT];
+int stats_port = 0;  // 0 disables the stats socket
+// Each room session's world is seeded with base_seed plus the session
+// number, so a run is reproducible from its base seed.
+uint64_t base_seed;
+unsigned long room_sessions = 0;  // guarded by rooms_mutex
+const char* record_prefix = NULL;  // record every room session if set
+const char* replay_path = NULL;
+const char* map_path = NULL;  // every room plays on this map if set
+Map map;
+// With a map file every room has the same walls, so they share the
+// encoded tiles as well as the mapped cells.
+OutBuffer** shared_tiles = NULL;
+int stats_socket = -1;
+long started_ms;
+
+Room* rooms;
+int max_rooms = DEFAULT_MAX_ROOMS;
+int active_rooms = 0;  // guarded by rooms_mutex
+pthread_mutex_t rooms_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+WorkDeque* work_deques;
+int rooms_pending = 0;
+unsigned long tick_generation = 0;  // guarded by pool_mutex
+pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t tick_start = PTHREAD_COND_INITIALIZER;
+pthread_cond_t tick_done = PTHREAD_COND_INITIALIZER;
+
+void mark_dirty(Connection* connection) {
+    Reactor* reactor = connection->reactor;
+    pthread_mutex_lock(&reactor->dirty_mutex);
+    int wake = reactor->dirty == NULL;
+    if (!connection->dirty) {
+        connection->dirty = 1;
+        connection->next_dirty = reactor->dirty;
+        reactor->dirty = connection;
+    }
+    pthread_mutex_unlock(&reactor->dirty_mutex);
+
+    if (wake) {
+        uint64_t one = 1;
+        if (write(reactor->event_fd, &one, sizeof(one)) < 0) {
+            perror("eventfd write");
         }
     }
 }
 
-void generate_walls() {
-    for (int y = 1; y < GRID_HEIGHT - 1; y++) {
-        for (int x = 1; x < GRID_WIDTH - 1; x++) {
-            if (rand() % 5 == 0) { 
-                grid[y][x] = 1;
-            }
+void note_queue_depth(int depth) {
+    int seen = __atomic_load_n(&outbound_stats.max_queue_depth, __ATOMIC_RELAXED);
+    while (depth > seen &&
+           !__atomic_compare_exchange_n(&outbound_stats.max_queue_depth, &seen, depth, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+// Queues a frame for the connection's reactor to write. Never blocks on the
+// socket; must be called with the connection's room mutex held.
+void send_to_connection(Connection* connection, OutBuffer* buffer) {
+    pthread_mutex_lock(&connection->out_mutex);
+    if (buffer->droppable && connection->out.count >= OUT_QUEUE_COLLAPSE_DEPTH) {
+        int dropped = out_queue_collapse(&connection->out);
+        __atomic_add_fetch(&outbound_stats.snapshots_dropped, dropped, __ATOMIC_RELAXED);
+    }
+    if (connection->overflowed || out_queue_push(&connection->out, buffer) < 0 ||
+        connection->out.bytes > out_queue_limit) {
+        connection->overflowed = 1;
+    }
+    int depth = connection->out.count;
+    pthread_mutex_unlock(&connection->out_mutex);
+
+    note_queue_depth(depth);
+    __atomic_add_fetch(&outbound_stats.frames_queued, 1, __ATOMIC_RELAXED);
+    mark_dirty(connection);
+}
+
+void send_text(Connection* connection, const char* text) {
+    OutBuffer* buffer = out_buffer_create(text, strlen(text), 0);
+    if (buffer == NULL) {
+        perror("Out buffer allocation failed");
+        return;
+    }
+    send_to_connection(connection, buffer);
+    out_buffer_release(buffer);
+}
+
+// Encodes a snapshot against a baseline (or in full when base is NULL)
+// into a new frame buffer.
+OutBuffer* encode_snapshot(Room* room, uint32_t base_tick, const EntityRecord* base, int base_count,
+                           const EntityRecord* entities, int count) {
+    World* world = &room->world;
+    SnapshotWriter writer;
+    snapshot_begin(&writer, room->encoded, snapshot_capacity, world->tick, base_tick, world->config.width,
+                   world->config.height);
+    if (base != NULL) {
+        snapshot_write_delta(&writer, base, base_count, entities, count);
+    } else {
+        for (int e = 0; e < count; e++) {
+            snapshot_add(&writer, &entities[e]);
+        }
+    }
+
+    int len = snapshot_finish(&writer);
+    if (len < 0) {
+        fprintf(stderr, "Snapshot exceeds %d bytes, dropped.\n", snapshot_capacity);
+        return NULL;
+    }
+    OutBuffer* state = out_buffer_create(room->encoded, len, 1);
+    if (state == NULL) {
+        perror("Out buffer allocation failed");
+    }
+    return state;
+}
+
+// Keeps the records within view_radius cells (a square) of (x, y). Order
+// is preserved, so the result is still sorted for delta encoding.
+int filter_view(const EntityRecord* in, int count, int x, int y, EntityRecord* out) {
+    int kept = 0;
+    for (int e = 0; e < count; e++) {
+        if (abs(in[e].x - x) <= view_radius && abs(in[e].y - y) <= view_radius) {
+            out[kept++] = in[e];
         }
     }
+    return kept;
 }
 
-void assign_player_id(Player* player, int id) {
-    player->id = id;
-    player->active = 1;
+// With a view radius every client gets its own snapshot. Entities that
+// cross the view edge show up as additions and removals in the delta.
+void send_views(Room* room, RoomClient* client, int slot, const StoredSnapshot* snapshot) {
+    World* world = &room->world;
+    int x = world->players.x[slot];
+    int y = world->players.y[slot];
+    int h = world->tick % SNAPSHOT_HISTORY;
+    client->view_tick[h] = world->tick;
+    client->view_x[h] = x;
+    client->view_y[h] = y;
 
-    do {
-        player->x = rand() % GRID_WIDTH;
-        player->y = rand() % GRID_HEIGHT;
-    } while (grid[player->y][player->x] != 0);
+    int count = filter_view(snapshot->entities, snapshot->count, x, y, room->visible);
 
-    char assign_msg[BUFFER_SIZE];
-    snprintf(assign_msg, sizeof(assign_msg), "ASSIGN_ID:%d", id);
-    send_data(player->socket, assign_msg);
+    const EntityRecord* base = NULL;
+    int base_count = 0;
+    uint32_t base_tick = 0;
+    StoredSnapshot* baseline = world_snapshot(world, client->acked_tick);
+    int b = client->acked_tick % SNAPSHOT_HISTORY;
+    if (baseline != NULL && client->view_tick[b] == baseline->tick) {
+        base = room->visible_base;
+        base_count = filter_view(baseline->entities, baseline->count, client->view_x[b], client->view_y[b],
+                                 room->visible_base);
+        base_tick = baseline->tick;
+    }
+
+    OutBuffer* state = encode_snapshot(room, base_tick, base, base_count, room->visible, count);
+    if (state != NULL) {
+        send_to_connection(client->connection, state);
+        out_buffer_release(state);
+    }
+}
+
+// Tile offsets on ring r around a centre: the 8r tiles at Chebyshev
+// distance r, walked clockwise from the top-left corner.
+int ring_length(int ring) {
+    return ring == 0 ? 1 : 8 * ring;
+}
+
+void ring_offset(int ring, int step, int* dx, int* dy) {
+    if (ring == 0) {
+        *dx = *dy = 0;
+        return;
+    }
+    int side = step / (2 * ring);
+    int along = step % (2 * ring);
+    switch (side) {
+        case 0: *dx = -ring + along; *dy = -ring; break;
+        case 1: *dx = ring; *dy = -ring + along; break;
+        case 2: *dx = ring - along; *dy = ring; break;
+        default: *dx = -ring; *dy = ring - along; break;
+    }
 }
 
-void broadcast_game_state() {
-    char state_msg[BUFFER_SIZE] = "GAME_STATE:";
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (players[i].active) {
-            char player_info[50];
-            snprintf(player_info, sizeof(player_info), "PLAYER:%d:%d:%d;", players[i].id, players[i].x, players[i].y);
-            strcat(state_msg, player_info);
+// Frames the connection has not got rid of yet.
+int connection_backlog(Connection* connection) {
+    pthread_mutex_lock(&connection->out_mutex);
+    int backlog = connection->out.count + connection->reliable_in_flight;
+    pthread_mutex_unlock(&connection->out_mutex);
+    return backlog;
+}
+
+// Sends a tile unless it is off the map or already sent. Returns 1 if it
+// was queued. Must be called with room->mutex held.
+int send_tile(Room* room, RoomClient* client, int slot, int tile_x, int tile_y) {
+    if (tile_x < 0 || tile_x >= tiles_across || tile_y < 0 || tile_y >= tiles_down) {
+        return 0;
+    }
+    int t = tile_y * tiles_across + tile_x;
+    uint8_t* sent = room->tiles_sent + (size_t)slot * tile_set_size;
+    if (sent[t >> 3] & (1 << (t & 7))) {
+        return 0;
+    }
+
+    // Rooms sharing tiles may race to encode one; the loser frees its copy.
+    OutBuffer* frame = __atomic_load_n(&room->tiles[t], __ATOMIC_ACQUIRE);
+    if (frame == NULL) {
+        uint8_t tile[MAP_TILE_SIZE];
+        int len = map_tile_encode(tile, room->world.grid, world_config.width, world_config.height, tile_x, tile_y);
+        OutBuffer* encoded = out_buffer_create(tile, len, 0);
+        if (encoded == NULL) {
+            perror("Out buffer allocation failed");
+            return 0;
+        }
+        if (__atomic_compare_exchange_n(&room->tiles[t], &frame, encoded, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            frame = encoded;
+        } else {
+            out_buffer_release(encoded);
         }
     }
+    send_to_connection(client->connection, frame);
+    sent[t >> 3] |= (uint8_t)(1 << (t & 7));
+    client->tiles_left--;
+    return 1;
+}
 
-    for (int y = 0; y < GRID_HEIGHT; y++) {
-        for (int x = 0; x < GRID_WIDTH; x++) {
-            if (grid[y][x] == 1) {
-                char wall_info[20];
-                snprintf(wall_info, sizeof(wall_info), "WALL:%d:%d;", x, y);
-                strcat(state_msg, wall_info);
-            }
+// Streams the map to a client: first whatever is missing around the
+// player, then the rest ring by ring outwards from where it joined.
+void stream_map(Room* room, RoomClient* client, int slot) {
+    if (client->tiles_left == 0) {
+        return;
+    }
+    int budget = MAP_TILE_BACKLOG - connection_backlog(client->connection);
+    if (budget > MAP_TILES_PER_TICK) {
+        budget = MAP_TILES_PER_TICK;
+    }
+
+    int x = room->world.players.x[slot] / MAP_TILE_CELLS;
+    int y = room->world.players.y[slot] / MAP_TILE_CELLS;
+    for (int ring = 0; ring <= MAP_NEAR_RING && budget > 0; ring++) {
+        for (int step = 0; step < ring_length(ring) && budget > 0; step++) {
+            int dx, dy;
+            ring_offset(ring, step, &dx, &dy);
+            budget -= send_tile(room, client, slot, x + dx, y + dy);
         }
     }
 
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (bullets[i].active) {
-            char bullet_info[30];
-            snprintf(bullet_info, sizeof(bullet_info), "BULLET:%d:%d:%d:%c;", i, bullets[i].x, bullets[i].y, bullets[i].direction);
-            strcat(state_msg, bullet_info);
+    int last_ring = tiles_across > tiles_down ? tiles_across : tiles_down;
+    while (budget > 0 && client->tiles_left > 0 && client->tile_ring <= last_ring) {
+        int dx, dy;
+        ring_offset(client->tile_ring, client->tile_step, &dx, &dy);
+        budget -= send_tile(room, client, slot, client->tile_center_x + dx, client->tile_center_y + dy);
+        if (++client->tile_step == ring_length(client->tile_ring)) {
+            client->tile_ring++;
+            client->tile_step = 0;
         }
     }
+}
+
+// Encodes each distinct snapshot once and queues the shared buffer on every
+// client in the room. Must be called with room->mutex held.
+void broadcast_room(Room* room) {
+    OutBuffer** states = room->states;
+    uint32_t* state_bases = room->state_bases;
+    int state_count = 0;
+
+    World* world = &room->world;
+    StoredSnapshot* snapshot = world_record(world);
 
-    for (int i = 0; i < MAX_GHOSTS; i++) {
-        if (ghosts[i].active) {
-            char ghost_info[30];
-            snprintf(ghost_info, sizeof(ghost_info), "GHOST:%d:%d;", ghosts[i].x, ghosts[i].y);
-            strcat(state_msg, ghost_info);
+    for (int i = 0; i < world->config.max_players; i++) {
+        RoomClient* client = &room->clients[i];
+        if (client->connection == NULL || !world->players.active[i]) {
+            continue;
+        }
+        stream_map(room, client, i);
+        if (view_radius > 0) {
+            send_views(room, client, i, snapshot);
+            continue;
+        }
+
+        // Clients acknowledging the same baseline share one encoding.
+        StoredSnapshot* baseline = world_snapshot(world, client->acked_tick);
+        uint32_t base_tick = baseline != NULL ? baseline->tick : 0;
+        int m = 0;
+        while (m < state_count && state_bases[m] != base_tick) {
+            m++;
+        }
+
+        if (m == state_count) {
+            states[m] = baseline != NULL
+                ? encode_snapshot(room, base_tick, baseline->entities, baseline->count, snapshot->entities, snapshot->count)
+                : encode_snapshot(room, 0, NULL, 0, snapshot->entities, snapshot->count);
+            state_bases[m] = base_tick;
+            state_count++;
+        }
+
+        if (states[m] != NULL) {
+            send_to_connection(client->connection, states[m]);
+        }
+    }
+
+    for (int m = 0; m < state_count; m++) {
+        if (states[m] != NULL) {
+            out_buffer_release(states[m]);
         }
     }
+}
+
+// Called from any reactor thread.
+void push_input(Room* room, Connection* connection, const Input* input) {
+    int* queued = &room->queued[connection->player_slot];
+    if (__atomic_add_fetch(queued, 1, __ATOMIC_RELAXED) > PLAYER_INPUT_DEPTH) {
+        __atomic_sub_fetch(queued, 1, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&inputs_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
 
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (players[i].active) {
-            send_data(players[i].socket, state_msg);
+    uint32_t mask = room->input_capacity - 1;
+    uint32_t position = __atomic_load_n(&room->input_head, __ATOMIC_RELAXED);
+    InputCell* cell;
+    while (1) {
+        cell = &room->inputs[position & mask];
+        int32_t lap = (int32_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - position);
+        if (lap == 0) {
+            // The slot is free; claim it unless another producer got there first.
+            if (__atomic_compare_exchange_n(&room->input_head, &position, position + 1, 1, __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (lap < 0) {
+            // Full. The per-player depth keeps this from happening.
+            __atomic_sub_fetch(queued, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&inputs_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            position = __atomic_load_n(&room->input_head, __ATOMIC_RELAXED);
         }
     }
+
+    cell->item.input = *input;
+    cell->item.arrival_tick = __atomic_load_n(&room->input_tick, __ATOMIC_RELAXED);
+    cell->item.session = connection->session;
+    __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+}
+
+// Must be called with room->mutex held. Returns 0 once the ring is empty.
+int pop_input(Room* room, QueuedInput* item) {
+    InputCell* cell = &room->inputs[room->input_tail & (room->input_capacity - 1)];
+    if (__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) != room->input_tail + 1) {
+        return 0;
+    }
+    *item = cell->item;
+    __atomic_store_n(&cell->sequence, room->input_tail + room->input_capacity, __ATOMIC_RELEASE);
+    room->input_tail++;
+    __atomic_sub_fetch(&room->queued[item->input.player_slot], 1, __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Drops inputs from a player who has since left the slot, and all but the
+// first inputs_per_tick a player sent within one tick. With MOVEs capped
+// at MAX_MOVE_STEPS, that bounds how far any client can move per tick.
+int accept_input(Room* room, const QueuedInput* item) {
+    int slot = item->input.player_slot;
+    RoomClient* client = &room->clients[slot];
+    if (client->connection == NULL || client->session != item->session) {
+        return 0;
+    }
+    if (room->limit_tick[slot] != item->arrival_tick) {
+        room->limit_tick[slot] = item->arrival_tick;
+        room->limit_count[slot] = 0;
+    }
+    if (++room->limit_count[slot] > inputs_per_tick) {
+        __atomic_add_fetch(&inputs_limited, 1, __ATOMIC_RELAXED);
+        return 0;
+    }
+    return 1;
 }
 
-void* handle_client(void* arg) {
-    int client_socket = *((int*)arg);
-    free(arg);
+void handle_command(Connection* connection, const uint8_t* command, int len) {
+    Room* room = connection->room;
+    int player_slot = connection->player_slot;
+    Message message;
+    if (message_parse(command, len, &message) < 0) {
+        return;
+    }
 
-    pthread_mutex_lock(&game_mutex);
-    int player_slot = -1;
-    for (int i = 0; i < MAX_PLAYERS; i++) {
-        if (!players[i].active) {
-            player_slot = i;
-            players[i].socket = client_socket;
-            assign_player_id(&players[i], i + 1);
-            players[i].start_time = time(NULL);  
+    switch (message.type) {
+        case MESSAGE_ACK: {
+            uint32_t tick = (uint32_t)message.fields[0];
+            pthread_mutex_lock(&room->mutex);
+            RoomClient* client = &room->clients[player_slot];
+            if (tick > client->acked_tick && tick <= room->world.tick) {
+                client->acked_tick = tick;
+            }
+            pthread_mutex_unlock(&room->mutex);
+            break;
+        }
+        case MESSAGE_MOVE: {
+            if (message.fields[0] < 1) {
+                break;
+            }
+            // The optional trailing seq is echoed back so the client can
+            // reconcile its predicted moves.
+            int steps = message.fields[0] > MAX_MOVE_STEPS ? MAX_MOVE_STEPS : (int)message.fields[0];
+            Input input = {player_slot, INPUT_MOVE, steps, (char)message.fields[1], (uint16_t)message.fields[2]};
+            push_input(room, connection, &input);
+            break;
+        }
+        case MESSAGE_SHOOT: {
+            Input input = {player_slot, INPUT_SHOOT, 0, (char)message.fields[0], 0};
+            push_input(room, connection, &input);
             break;
         }
+        default:
+            break;
+    }
+}
+
+int allocate_room(Room* room) {
+    int max_players = world_config.max_players;
+    room->clients = calloc(max_players, sizeof(RoomClient));
+    room->states = calloc(max_players, sizeof(OutBuffer*));
+    room->state_bases = calloc(max_players, sizeof(uint32_t));
+    room->encoded = malloc(snapshot_capacity);
+    room->visible = malloc(world_max_entities(&world_config) * sizeof(EntityRecord));
+    room->visible_base = malloc(world_max_entities(&world_config) * sizeof(EntityRecord));
+    room->input_capacity = 1;
+    while (room->input_capacity < (uint32_t)max_players * PLAYER_INPUT_DEPTH) {
+        room->input_capacity *= 2;
+    }
+    room->inputs = malloc(room->input_capacity * sizeof(InputCell));
+    room->queued = calloc(max_players, sizeof(int));
+    room->limit_tick = calloc(max_players, sizeof(uint32_t));
+    room->limit_count = calloc(max_players, sizeof(int));
+    room->tiles = shared_tiles != NULL ? shared_tiles : calloc(tile_count, sizeof(OutBuffer*));
+    room->tiles_sent = malloc((size_t)max_players * tile_set_size);
+    if (room->clients == NULL || room->states == NULL || room->state_bases == NULL || room->encoded == NULL ||
+        room->visible == NULL || room->visible_base == NULL || room->inputs == NULL || room->queued == NULL ||
+        room->limit_tick == NULL || room->limit_count == NULL || room->tiles == NULL || room->tiles_sent == NULL ||
+        world_create(&room->world, &world_config) < 0) {
+        perror("Room allocation failed");
+        world_destroy(&room->world);
+        free(room->clients);
+        free(room->states);
+        free(room->state_bases);
+        free(room->encoded);
+        free(room->visible);
+        free(room->visible_base);
+        free(room->inputs);
+        free(room->queued);
+        free(room->limit_tick);
+        free(room->limit_count);
+        if (room->tiles != shared_tiles) {
+            free(room->tiles);
+        }
+        free(room->tiles_sent);
+        room->clients = NULL;
+        return -1;
+    }
+    for (uint32_t i = 0; i < room->input_capacity; i++) {
+        room->inputs[i].sequence = i;
+    }
+    room->input_head = 0;
+    room->input_tail = 0;
+    return 0;
+}
+
+int open_room(Room* room) {
+    if (room->clients == NULL && allocate_room(room) < 0) {
+        return -1;
+    }
+
+    uint64_t seed = base_seed + room_sessions++;
+    pthread_mutex_lock(&room->mutex);
+    world_init(&room->world, seed);
+    memset(room->clients, 0, world_config.max_players * sizeof(RoomClient));
+    // input_tick restarts at 0, so counts left over from the last session
+    // would otherwise limit the new players.
+    memset(room->limit_tick, 0, world_config.max_players * sizeof(uint32_t));
+    memset(room->limit_count, 0, world_config.max_players * sizeof(int));
+    // Unless there is a map, the new world has new walls.
+    for (int t = 0; room->tiles != shared_tiles && t < tile_count; t++) {
+        if (room->tiles[t] != NULL) {
+            out_buffer_release(room->tiles[t]);
+            room->tiles[t] = NULL;
+        }
+    }
+    room->active = 1;
+    if (record_prefix != NULL) {
+        char path[1024];
+        snprintf(path, sizeof(path), "%s.%lu.rec", record_prefix, room_sessions);
+        if (recorder_open(&room->recorder, path, &world_config, seed, ghost_interval) == 0) {
+            printf("Recording room %d to %s\n", room->id, path);
+        }
+    }
+    __atomic_store_n(&room->input_tick, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&room->mutex);
+    return 0;
+}
+
+// Places the connection in the fullest room that still has a free slot,
+// opening a new room only when every active one is full.
+int join_room(Connection* connection) {
+    pthread_mutex_lock(&rooms_mutex);
+    Room* room = NULL;
+    Room* idle = NULL;
+    for (int i = 0; i < max_rooms; i++) {
+        Room* candidate = &rooms[i];
+        if (!candidate->active) {
+            if (idle == NULL) {
+                idle = candidate;
+            }
+        } else if (candidate->client_count < world_config.max_players &&
+                   (room == NULL || candidate->client_count > room->client_count)) {
+            room = candidate;
+        }
+    }
+    if (room == NULL && idle != NULL && open_room(idle) == 0) {
+        room = idle;
+        active_rooms++;
+    }
+    if (room == NULL) {
+        pthread_mutex_unlock(&rooms_mutex);
+        return -1;
+    }
+    room->client_count++;
+
+    // A slot stays taken until its connection closes, even after the
+    // player dies, so a late command can never steer someone else.
+    pthread_mutex_lock(&room->mutex);
+    int slot = 0;
+    while (room->clients[slot].connection != NULL) {
+        slot++;
+    }
+    memset(&room->clients[slot], 0, sizeof(RoomClient));
+    room->clients[slot].connection = connection;
+    room->clients[slot].session = connection->session = ++join_sessions;
+    connection->room = room;
+    connection->player_slot = slot;
+    world_add_player(&room->world, slot, slot + 1);
+    recorder_join(&room->recorder, &room->world, slot, slot + 1);
+    RoomClient* client = &room->clients[slot];
+    client->tiles_left = tile_count;
+    client->tile_center_x = room->world.players.x[slot] / MAP_TILE_CELLS;
+    client->tile_center_y = room->world.players.y[slot] / MAP_TILE_CELLS;
+    memset(room->tiles_sent + (size_t)slot * tile_set_size, 0, tile_set_size);
+
+    // The client sizes its world from the handshake.
+    char assign_msg[BUFFER_SIZE];
+    snprintf(assign_msg, sizeof(assign_msg), "ASSIGN_ID:%d:%d:%d:%d:%d:%d", slot + 1, world_config.width,
+             world_config.height, world_config.max_players, world_config.max_ghosts, room->world.max_bullets);
+    send_text(connection, assign_msg);
+    pthread_mutex_unlock(&room->mutex);
+
+    pthread_mutex_unlock(&rooms_mutex);
+    return 0;
+}
+
+void leave_room(Connection* connection) {
+    Room* room = connection->room;
+    int slot = connection->player_slot;
+
+    pthread_mutex_lock(&rooms_mutex);
+    pthread_mutex_lock(&room->mutex);
+    printf("Player %d in room %d disconnected.\n", slot + 1, room->id);
+    world_remove_player(&room->world, slot);
+    recorder_leave(&room->recorder, &room->world, slot);
+    room->clients[slot].connection = NULL;
+    if (--room->client_count == 0) {
+        room->active = 0;
+        active_rooms--;
+        recorder_close(&room->recorder);
     }
-    pthread_mutex_unlock(&game_mutex);
+    pthread_mutex_unlock(&room->mutex);
+    pthread_mutex_unlock(&rooms_mutex);
+}
 
-    if (player_slot == -1) {
-        close(client_socket);
-        printf("Connection refused: Max players reached.\n");
+int peer_bucket(const struct sockaddr_in* peer) {
+    return (int)((ntohl(peer->sin_addr.s_addr) * 31u + ntohs(peer->sin_port)) % PEER_BUCKETS);
+}
+
+Connection* find_peer(Reactor* reactor, const struct sockaddr_in* peer) {
+    Connection* connection = reactor->peers[peer_bucket(peer)];
+    while (connection != NULL && (connection->peer.sin_addr.s_addr != peer->sin_addr.s_addr ||
+                                  connection->peer.sin_port != peer->sin_port)) {
+        connection = connection->next_peer;
+    }
+    return connection;
+}
+
+// Peer is the client's address in UDP mode, where client_socket is the
+// reactor's shared socket, and NULL for TCP. The caller keeps ownership of
+// the socket if this fails.
+Connection* open_connection(Reactor* reactor, int client_socket, const struct sockaddr_in* peer) {
+    Connection* connection = malloc(sizeof(Connection));
+    if (connection == NULL || frame_buffer_init(&connection->frames, BUFFER_SIZE) < 0) {
+        perror("Connection allocation failed");
+        free(connection);
         return NULL;
     }
+    connection->socket = client_socket;
+    connection->room = NULL;
+    connection->player_slot = -1;
+    connection->reactor = reactor;
+    pthread_mutex_init(&connection->out_mutex, NULL);
+    out_queue_init(&connection->out);
+    connection->overflowed = 0;
+    connection->reliable_in_flight = 0;
+    connection->dirty = 0;
+    connection->next_dirty = NULL;
+    connection->want_write = 0;
+    connection->closing = 0;
+    connection->next_closed = NULL;
+    if (peer != NULL) {
+        connection->peer = *peer;
+    }
+    channel_init(&connection->channel);
+    connection->last_heard_ms = clock_ms();
+    connection->next_peer = NULL;
+    connection->messages_sent = 0;
+    connection->bytes_sent = 0;
+
+    if (join_room(connection) < 0) {
+        printf("Connection refused: No room available.\n");
+        pthread_mutex_destroy(&connection->out_mutex);
+        frame_buffer_free(&connection->frames);
+        free(connection);
+        return NULL;
+    }
+    return connection;
+}
+
+// Detaches the connection from its room and the reactor at once but only
+// queues it for free_closed(), since a later event in the same epoll batch
+// may still point at it.
+void close_connection(Connection* connection) {
+    if (connection->closing) {
+        return;
+    }
+    connection->closing = 1;
+    leave_room(connection);
+
+    // Nothing can queue frames for the connection any more; forget it if
+    // the simulation marked it dirty before we detached it.
+    Reactor* reactor = connection->reactor;
+    pthread_mutex_lock(&reactor->dirty_mutex);
+    if (connection->dirty) {
+        Connection** link = &reactor->dirty;
+        while (*link != connection) {
+            link = &(*link)->next_dirty;
+        }
+        *link = connection->next_dirty;
+    }
+    pthread_mutex_unlock(&reactor->dirty_mutex);
+
+    if (udp_mode) {
+        Connection** link = &reactor->peers[peer_bucket(&connection->peer)];
+        while (*link != connection) {
+            link = &(*link)->next_peer;
+        }
+        *link = connection->next_peer;
+    } else {
+        // Fails harmlessly if the socket was never added.
+        epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, connection->socket, NULL);
+    }
+    connection->next_closed = reactor->closed;
+    reactor->closed = connection;
+}
+
+// Frees the connections closed while handling the last batch of events.
+void free_closed(Reactor* reactor) {
+    while (reactor->closed != NULL) {
+        Connection* connection = reactor->closed;
+        reactor->closed = connection->next_closed;
+        if (udp_mode) {
+            channel_clear(&connection->channel);
+        } else {
+            close(connection->socket);
+        }
+        out_queue_clear(&connection->out);
+        pthread_mutex_destroy(&connection->out_mutex);
+        frame_buffer_free(&connection->frames);
+        free(connection);
+    }
+}
+
+// Snapshots go out unreliable, everything else on the reliable channel.
+// The queue always drains; there is no partial write to come back for.
+int flush_datagrams(Connection* connection) {
+    pthread_mutex_lock(&connection->out_mutex);
+    int overflowed = connection->overflowed;
+    OutBuffer* buffer;
+    while (!overflowed && (buffer = out_queue_pop(&connection->out)) != NULL) {
+        if (channel_send(connection->socket, &connection->peer, &connection->channel,
+                         buffer->data + FRAME_HEADER_SIZE, buffer->len - FRAME_HEADER_SIZE, !buffer->droppable) < 0) {
+            overflowed = connection->overflowed = 1;
+        } else {
+            __atomic_add_fetch(&connection->messages_sent, 1, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&connection->bytes_sent, buffer->len - FRAME_HEADER_SIZE, __ATOMIC_RELAXED);
+        }
+        out_buffer_release(buffer);
+    }
+    connection->reliable_in_flight = connection->channel.reliable_next - connection->channel.reliable_acked - 1;
+    pthread_mutex_unlock(&connection->out_mutex);
+
+    if (overflowed) {
+        printf("Player %d in room %d is too slow, disconnecting.\n", connection->player_slot + 1, connection->room->id);
+        __atomic_add_fetch(&outbound_stats.slow_disconnects, 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return 0;
+}
+
+int flush_stream(Connection* connection) {
+    pthread_mutex_lock(&connection->out_mutex);
+    int overflowed = connection->overflowed;
+    int count = connection->out.count;
+    int bytes = connection->out.bytes;
+    int status = overflowed ? -1 : out_queue_flush(connection->socket, &connection->out);
+    // Frames count once fully written.
+    __atomic_add_fetch(&connection->messages_sent, count - connection->out.count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&connection->bytes_sent, bytes - connection->out.bytes, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&connection->out_mutex);
+
+    if (overflowed) {
+        printf("Player %d in room %d is too slow, disconnecting.\n", connection->player_slot + 1, connection->room->id);
+        __atomic_add_fetch(&outbound_stats.slow_disconnects, 1, __ATOMIC_RELAXED);
+    }
+    if (status < 0) {
+        return -1;
+    }
+
+    // Only ask for EPOLLOUT while there is something left to write.
+    int want_write = status == 0;
+    if (want_write != connection->want_write) {
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+        event.data.ptr = connection;
+        if (epoll_ctl(connection->reactor->epoll_fd, EPOLL_CTL_MOD, connection->socket, &event) < 0) {
+            perror("epoll_ctl");
+            return -1;
+        }
+        connection->want_write = want_write;
+    }
+    return 0;
+}
 
-    char buffer[BUFFER_SIZE];
+int flush_connection(Connection* connection) {
+    long start = clock_ns();
+    int status = udp_mode ? flush_datagrams(connection) : flush_stream(connection);
+    histogram_add(&phase_histograms[PHASE_SEND], clock_ns() - start);
+    return status;
+}
+
+void flush_dirty(Reactor* reactor) {
+    uint64_t wakeups;
+    if (read(reactor->event_fd, &wakeups, sizeof(wakeups)) < 0 && errno != EAGAIN) {
+        perror("eventfd read");
+    }
+
+    pthread_mutex_lock(&reactor->dirty_mutex);
+    Connection* connection = reactor->dirty;
+    reactor->dirty = NULL;
+    pthread_mutex_unlock(&reactor->dirty_mutex);
+
+    while (connection != NULL) {
+        // Clear the flag before flushing so a frame queued meanwhile puts the
+        // connection back on the list instead of being missed.
+        pthread_mutex_lock(&reactor->dirty_mutex);
+        Connection* next = connection->next_dirty;
+        connection->dirty = 0;
+        pthread_mutex_unlock(&reactor->dirty_mutex);
+
+        if (flush_connection(connection) < 0) {
+            close_connection(connection);
+        }
+        connection = next;
+    }
+}
+
+void accept_connections(Reactor* reactor) {
     while (1) {
-        int bytes_received = receive_data(client_socket, buffer, BUFFER_SIZE);
-        if (bytes_received <= 0) {
-            printf("Player %d disconnected.\n", players[player_slot].id);
-            pthread_mutex_lock(&game_mutex);
-            players[player_slot].active = 0;
-            pthread_mutex_unlock(&game_mutex);
+        int client_socket = accept4(server_socket, NULL, NULL, SOCK_NONBLOCK);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                perror("Accept failed");
+            }
+            return;
+        }
+
+        Connection* connection = open_connection(reactor, client_socket, NULL);
+        if (connection == NULL) {
             close(client_socket);
-            break;
+            continue;
         }
 
-        if (strncmp(buffer, "ACTION:MOVE:", 12) == 0) {
-            int steps = 1;
-            char direction;
-            sscanf(buffer + 12, "%d:%c", &steps, &direction);
+        struct epoll_event event;
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.ptr = connection;
+        if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_socket, &event) < 0) {
+            perror("epoll_ctl");
+            close_connection(connection);
+        }
+    }
+}
 
-            int dx = 0, dy = 0;
-            switch (direction) {
-                case 'W': dy = -steps; break;
-                case 'S': dy = steps; break;
-                case 'A': dx = -steps; break;
-                case 'D': dx = steps; break;
-            }
+int read_connection(Connection* connection) {
+    int bytes_received = receive_frames(connection->socket, &connection->frames);
+    if (bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        return 0;
+    }
+
+    const uint8_t* payload;
+    int len;
+    int status = 0;
+
+    // One read may carry several queued commands; all of them reach the
+    // next tick.
+    while (bytes_received > 0 && (status = next_frame(&connection->frames, &payload, &len)) > 0) {
+        handle_command(connection, payload, len);
+    }
 
-            pthread_mutex_lock(&game_mutex);
-            int new_x = players[player_slot].x + dx;
-            int new_y = players[player_slot].y + dy;
+    return (bytes_received <= 0 || status < 0) ? -1 : 0;
+}
 
-            if (new_x >= 0 && new_x < GRID_WIDTH && new_y >= 0 && new_y < GRID_HEIGHT && grid[new_y][new_x] == 0) {
-                players[player_slot].x = new_x;
-                players[player_slot].y = new_y;
+// Drains the reactor's UDP socket. A datagram from an unknown address
+// opens a connection only if it is a client's first CONNECT.
+void read_datagrams(Reactor* reactor) {
+    while (1) {
+        struct sockaddr_in peer;
+        int len = receive_datagram(reactor->datagram_socket, reactor->datagram, &peer);
+        if (len < 0) {
+            return;
+        }
+
+        Connection* connection = find_peer(reactor, &peer);
+        if (connection == NULL) {
+            if (!datagram_is_connect(reactor->datagram, len)) {
+                continue;
+            }
+            if ((connection = open_connection(reactor, reactor->datagram_socket, &peer)) == NULL) {
+                // Without an answer the peer would take the refusal for
+                // loss and keep resending CONNECT.
+                channel_disconnect(reactor->datagram_socket, &peer);
+                continue;
             }
-            pthread_mutex_unlock(&game_mutex);
+            int bucket = peer_bucket(&peer);
+            connection->next_peer = reactor->peers[bucket];
+            reactor->peers[bucket] = connection;
+        }
+        connection->last_heard_ms = clock_ms();
+
+        const uint8_t* payload;
+        int payload_len;
+        int status = channel_receive(reactor->datagram_socket, &connection->peer, &connection->channel,
+                                     reactor->datagram, len, &payload, &payload_len);
+        if (status < 0) {
+            close_connection(connection);
+        } else if (status > 0) {
+            handle_command(connection, payload, payload_len);
+        }
+    }
+}
 
-            broadcast_game_state();
-        } else if (strncmp(buffer, "ACTION:SHOOT:", 13) == 0) {
-            char direction;
-            sscanf(buffer + 13, "%c", &direction);
+// Resends overdue reliable messages and drops peers that went quiet.
+void service_peers(Reactor* reactor) {
+    long now = clock_ms();
+    for (int b = 0; b < PEER_BUCKETS; b++) {
+        Connection* connection = reactor->peers[b];
+        while (connection != NULL) {
+            Connection* next = connection->next_peer;
+            if (now - connection->last_heard_ms > PEER_TIMEOUT_MS ||
+                channel_resend(connection->socket, &connection->peer, &connection->channel) < 0) {
+                printf("Player %d in room %d timed out.\n", connection->player_slot + 1, connection->room->id);
+                close_connection(connection);
+            }
+            connection = next;
+        }
+    }
+    reactor->service_at_ms = now + RESEND_INTERVAL_MS;
+}
 
-            pthread_mutex_lock(&game_mutex);
-            bullets[player_slot].x = players[player_slot].x;
-            bullets[player_slot].y = players[player_slot].y;
-            bullets[player_slot].direction = direction;
-            bullets[player_slot].active = 1;
-            pthread_mutex_unlock(&game_mutex);
+void init_reactor(Reactor* reactor) {
+    reactor->epoll_fd = epoll_create1(0);
+    reactor->event_fd = eventfd(0, EFD_NONBLOCK);
+    if (reactor->epoll_fd < 0 || reactor->event_fd < 0) {
+        perror("Reactor setup failed");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&reactor->dirty_mutex, NULL);
+    reactor->dirty = NULL;
+    reactor->closed = NULL;
 
-            broadcast_game_state();
+    // Every reactor watches the listen socket; EPOLLEXCLUSIVE wakes only one
+    // of them per incoming connection, and that one owns it from then on.
+    // In UDP mode each has its own socket and the kernel spreads peers.
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    int listen_socket = server_socket;
+    if (udp_mode) {
+        reactor->datagram_socket = init_server_datagram_socket(DEFAULT_PORT);
+        reactor->datagram = malloc(DATAGRAM_MAX_SIZE);
+        reactor->peers = calloc(PEER_BUCKETS, sizeof(Connection*));
+        if (reactor->datagram == NULL || reactor->peers == NULL) {
+            perror("Reactor setup failed");
+            exit(EXIT_FAILURE);
         }
+        reactor->service_at_ms = clock_ms() + RESEND_INTERVAL_MS;
+        listen_socket = reactor->datagram_socket;
+        event.events = EPOLLIN;
+    }
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, listen_socket, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
     }
 
-    return NULL;
+    event.events = EPOLLIN;
+    event.data.ptr = reactor;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->event_fd, &event) < 0) {
+        perror("epoll_ctl");
+        exit(EXIT_FAILURE);
+    }
 }
 
-void* bullet_thread(void* arg) {
-    (void)arg;  
+void* reactor_thread(void* arg) {
+    Reactor* reactor = arg;
+    struct epoll_event events[MAX_EVENTS];
     while (1) {
-        pthread_mutex_lock(&game_mutex);
-        for (int i = 0; i < MAX_PLAYERS; i++) {
-            if (bullets[i].active) {
-                int dx = 0, dy = 0;
-                switch (bullets[i].direction) {
-                    case 'U': dy = -1; break;
-                    case 'D': dy = 1; break;
-                    case 'L': dx = -1; break;
-                    case 'R': dx = 1; break;
-                }
-
-                int new_x = bullets[i].x + dx;
-                int new_y = bullets[i].y + dy;
+        int n = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, udp_mode ? RESEND_INTERVAL_MS : -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait");
+            exit(EXIT_FAILURE);
+        }
 
-                if (new_x < 0 || new_x >= GRID_WIDTH || new_y < 0 || new_y >= GRID_HEIGHT || grid[new_y][new_x] == 1) {
-                    bullets[i].active = 0;
+        for (int i = 0; i < n; i++) {
+            void* ptr = events[i].data.ptr;
+            if (ptr == NULL) {
+                if (udp_mode) {
+                    read_datagrams(reactor);
                 } else {
-                    for (int j = 0; j < MAX_PLAYERS; j++) {
-                        if (players[j].active && players[j].x == new_x && players[j].y == new_y) {
-                            players[j].active = 0;
-                            bullets[i].active = 0;
-                            printf("Player %d was hit by a bullet!\n", players[j].id);
-
-                            char game_over_msg[BUFFER_SIZE];
-                            int survival_time = (int)(time(NULL) - players[j].start_time);
-                            snprintf(game_over_msg, sizeof(game_over_msg), "GAME_OVER:%d", survival_time);
-                            send(players[j].socket, game_over_msg, strlen(game_over_msg), 0);
-                            break;
-                        }
-                    }
-                    for (int j = 0; j < MAX_GHOSTS; j++) {
-                        if (ghosts[j].active && ghosts[j].x == new_x && ghosts[j].y == new_y) {
-                            ghosts[j].active = 0;
-                            bullets[i].active = 0;
-                            printf("Ghost at (%d, %d) was killed by a bullet!\n", new_x, new_y);
-                            break;
-                        }
-                    }
-                    if (bullets[i].active) {
-                        bullets[i].x = new_x;
-                        bullets[i].y = new_y;
-                    }
+                    accept_connections(reactor);
+                }
+            } else if (ptr == reactor) {
+                flush_dirty(reactor);
+            } else {
+                Connection* connection = ptr;
+                if (connection->closing) {
+                    continue;  // closed earlier in this batch
+                }
+                uint32_t ready = events[i].events;
+                if (((ready & EPOLLOUT) && flush_connection(connection) < 0) ||
+                    ((ready & ~EPOLLOUT) && read_connection(connection) < 0)) {
+                    close_connection(connection);
                 }
             }
         }
-        pthread_mutex_unlock(&game_mutex);
 
-        broadcast_game_state();
-        usleep(100000); 
+        if (udp_mode && clock_ms() >= reactor->service_at_ms) {
+            service_peers(reactor);
+        }
+        free_closed(reactor);
     }
     return NULL;
 }
 
-void* ghost_thread(void* arg) {
-    (void)arg;  
-    while (1) {
-        pthread_mutex_lock(&game_mutex);
-
-        if (rand() % 100 < 20) {  
-            for (int i = 0; i < MAX_GHOSTS; i++) {
-                if (!ghosts[i].active) {
-                    ghosts[i].active = 1;
-
-                    if (rand() % 2 == 0) {
-                        ghosts[i].x = (rand() % 2) * (GRID_WIDTH - 1);
-                        ghosts[i].y = rand() % GRID_HEIGHT;
-                    } else {
-                        ghosts[i].x = rand() % GRID_WIDTH;
-                        ghosts[i].y = (rand() % 2) * (GRID_HEIGHT - 1);
-                    }
-                    break;
-                }
+void raise_fd_limit() {
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+void run_room_tick(Room* room) {
+    pthread_mutex_lock(&room->mutex);
+    // The room may have emptied since the scheduler picked it.
+    if (room->active) {
+        World* world = &room->world;
+        long start = clock_ns();
+        // At most one lap, so inputs arriving meanwhile wait for the next tick.
+        QueuedInput item;
+        for (uint32_t n = 0; n < room->input_capacity && pop_input(room, &item); n++) {
+            if (accept_input(room, &item)) {
+                world_apply_input(world, &item.input);
+                recorder_input(&room->recorder, world, &item.input);
             }
         }
+        histogram_add(&phase_histograms[PHASE_INPUT], clock_ns() - start);
 
-        for (int i = 0; i < MAX_GHOSTS; i++) {
-            if (ghosts[i].active) {
-                int closest_player = -1;
-                int min_distance = GRID_WIDTH * GRID_HEIGHT;
-                for (int j = 0; j < MAX_PLAYERS; j++) {
-                    if (players[j].active) {
-                        int distance = abs(players[j].x - ghosts[i].x) + abs(players[j].y - ghosts[i].y);
-                        if (distance < min_distance) {
-                            min_distance = distance;
-                            closest_player = j;
-                        }
-                    }
-                }
+        world_step(world, ghost_interval);
+        recorder_checksum(&room->recorder, world);
+        __atomic_store_n(&room->input_tick, world->tick, __ATOMIC_RELAXED);
+        histogram_add(&phase_histograms[PHASE_BULLETS], world->bullets_ns);
+        if (world->tick % ghost_interval == 0) {
+            histogram_add(&phase_histograms[PHASE_GHOSTS], world->ghosts_ns);
+        }
 
-                if (closest_player != -1) {
-                    int dx = players[closest_player].x - ghosts[i].x;
-                    int dy = players[closest_player].y - ghosts[i].y;
-                    if (abs(dx) > abs(dy)) {
-                        ghosts[i].x += (dx > 0) ? 1 : -1;
-                    } else {
-                        ghosts[i].y += (dy > 0) ? 1 : -1;
-                    }
-
-                    if (ghosts[i].x == players[closest_player].x && ghosts[i].y == players[closest_player].y) {
-                        players[closest_player].active = 0;
-                        printf("Player %d was caught by a ghost!\n", players[closest_player].id);
-
-                        char game_over_msg[BUFFER_SIZE];
-                        snprintf(game_over_msg, sizeof(game_over_msg), "GAME_OVER");
-                        send(players[closest_player].socket, game_over_msg, strlen(game_over_msg), 0);
-                    }
-                }
+        int players = 0;
+        for (int i = 0; i < world->config.max_players; i++) {
+            players += world->players.active[i];
+        }
+        __atomic_add_fetch(&tick_entities[ENTITY_PLAYER], players, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&tick_entities[ENTITY_BULLET], world->bullets.count, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&tick_entities[ENTITY_GHOST], world->ghosts.count, __ATOMIC_RELAXED);
+
+        for (int i = 0; i < world->event_count; i++) {
+            WorldEvent* event = &world->events[i];
+            Connection* connection = room->clients[event->player_slot].connection;
+            if (connection == NULL) {
+                continue;
             }
+            if (event->type == EVENT_PLAYER_HIT) {
+                char game_over_msg[32];
+                snprintf(game_over_msg, sizeof(game_over_msg), "GAME_OVER:%u", event->survival_ticks / tick_rate);
+                send_text(connection, game_over_msg);
+            } else {
+                send_text(connection, "GAME_OVER");
+            }
+        }
+
+        long serialize_start = clock_ns();
+        broadcast_room(room);
+        histogram_add(&phase_histograms[PHASE_SERIALIZE], clock_ns() - serialize_start);
+    }
+    pthread_mutex_unlock(&room->mutex);
+}
+
+void push_work(WorkDeque* deque, Room* room) {
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->head == deque->tail) {
+        deque->head = 0;
+        deque->tail = 0;
+    }
+    deque->rooms[deque->tail++] = room;
+    pthread_mutex_unlock(&deque->mutex);
+}
+
+Room* pop_work(WorkDeque* deque, int steal) {
+    Room* room = NULL;
+    pthread_mutex_lock(&deque->mutex);
+    if (deque->head < deque->tail) {
+        room = steal ? deque->rooms[deque->head++] : deque->rooms[--deque->tail];
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return room;
+}
+
+Room* take_work(int worker) {
+    Room* room = pop_work(&work_deques[worker], 0);
+    for (int i = 1; room == NULL && i < worker_threads; i++) {
+        room = pop_work(&work_deques[(worker + i) % worker_threads], 1);
+    }
+    return room;
+}
+
+void* worker_thread(void* arg) {
+    int worker = (int)(intptr_t)arg;
+    unsigned long generation = 0;
+    while (1) {
+        pthread_mutex_lock(&pool_mutex);
+        while (tick_generation == generation) {
+            pthread_cond_wait(&tick_start, &pool_mutex);
         }
-        pthread_mutex_unlock(&game_mutex);
+        generation = tick_generation;
+        pthread_mutex_unlock(&pool_mutex);
 
-        broadcast_game_state();
-        usleep(500000); 
+        Room* room;
+        while ((room = take_work(worker)) != NULL) {
+            run_room_tick(room);
+            if (__atomic_sub_fetch(&rooms_pending, 1, __ATOMIC_ACQ_REL) == 0) {
+                pthread_mutex_lock(&pool_mutex);
+                pthread_cond_signal(&tick_done);
+                pthread_mutex_unlock(&pool_mutex);
+            }
+        }
     }
     return NULL;
 }
 
-int main() {
-    srand(time(NULL));  
+void init_workers() {
+    work_deques = calloc(worker_threads, sizeof(WorkDeque));
+    for (int i = 0; i < worker_threads; i++) {
+        pthread_mutex_init(&work_deques[i].mutex, NULL);
+        work_deques[i].rooms = malloc(max_rooms * sizeof(Room*));
+        if (work_deques[i].rooms == NULL) {
+            perror("Worker setup failed");
+            exit(EXIT_FAILURE);
+        }
+
+        pthread_t worker_tid;
+        pthread_create(&worker_tid, NULL, worker_thread, (void*)(intptr_t)i);
+        pthread_detach(worker_tid);
+    }
+}
+
+// Deals every active room out to the workers and waits until all of them
+// have been stepped.
+void run_tick() {
+    pthread_mutex_lock(&rooms_mutex);
+    int count = 0;
+    for (int i = 0; i < max_rooms; i++) {
+        if (rooms[i].active) {
+            count++;
+        }
+    }
+    __atomic_store_n(&rooms_pending, count, __ATOMIC_RELEASE);
+    for (int i = 0, n = 0; i < max_rooms; i++) {
+        if (rooms[i].active) {
+            push_work(&work_deques[n++ % worker_threads], &rooms[i]);
+        }
+    }
+    pthread_mutex_unlock(&rooms_mutex);
 
-    int server_socket = init_server_socket(DEFAULT_PORT);
-    printf("Server started on port %d\n", DEFAULT_PORT);
+    if (count == 0) {
+        return;
+    }
 
-    initialize_grid();
-    generate_walls();
+    pthread_mutex_lock(&pool_mutex);
+    tick_generation++;
+    pthread_cond_broadcast(&tick_start);
+    while (__atomic_load_n(&rooms_pending, __ATOMIC_ACQUIRE) > 0) {
+        pthread_cond_wait(&tick_done, &pool_mutex);
+    }
+    pthread_mutex_unlock(&pool_mutex);
+}
 
-    pthread_t bullet_tid, ghost_tid;
-    pthread_create(&bullet_tid, NULL, bullet_thread, NULL);
-    pthread_create(&ghost_tid, NULL, ghost_thread, NULL);
+static void timespec_add_ns(struct timespec* ts, long ns) {
+    ts->tv_nsec += ns % 1000000000L;
+    ts->tv_sec += ns / 1000000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_nsec -= 1000000000L;
+        ts->tv_sec++;
+    }
+}
+
+static long timespec_diff_ns(const struct timespec* a, const struct timespec* b) {
+    return (a->tv_sec - b->tv_sec) * 1000000000L + (a->tv_nsec - b->tv_nsec);
+}
+
+void* simulation_thread(void* arg) {
+    (void)arg;
+    long period_ns = 1000000000L / tick_rate;
+    unsigned long reported_overruns = 0;
+    unsigned long reported_drops = 0;
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
 
     while (1) {
-        struct sockaddr_in client_address;
-        socklen_t client_len = sizeof(client_address);
-        int* client_socket = malloc(sizeof(int));
-        *client_socket = accept(server_socket, (struct sockaddr*)&client_address, &client_len);
-
-        if (*client_socket < 0) {
-            perror("Accept failed");
-            free(client_socket);
+        long start = clock_ns();
+        run_tick();
+        histogram_add(&phase_histograms[PHASE_TICK], clock_ns() - start);
+        for (int k = 0; k < ENTITY_KIND_COUNT; k++) {
+            __atomic_store_n(&entity_counts[k], __atomic_exchange_n(&tick_entities[k], 0, __ATOMIC_RELAXED),
+                             __ATOMIC_RELAXED);
+        }
+        tick_stats.ticks++;
+
+        if (tick_stats.ticks % (unsigned long)(tick_rate * 10) == 0 && tick_stats.overruns != reported_overruns) {
+            printf("Tick stats: %lu ticks, %lu overruns, %lu skipped, worst lag %.2f ms\n",
+                   tick_stats.ticks, tick_stats.overruns, tick_stats.skipped, tick_stats.worst_lag_ns / 1e6);
+            reported_overruns = tick_stats.overruns;
+        }
+        unsigned long drops = outbound_stats.snapshots_dropped + outbound_stats.slow_disconnects;
+        if (tick_stats.ticks % (unsigned long)(tick_rate * 10) == 0 && drops != reported_drops) {
+            printf("Outbound stats: %lu frames queued, %lu snapshots dropped, %lu slow disconnects, max queue depth %d\n",
+                   outbound_stats.frames_queued, outbound_stats.snapshots_dropped,
+                   outbound_stats.slow_disconnects, outbound_stats.max_queue_depth);
+            reported_drops = drops;
+        }
+
+        // Deadlines are absolute, so time spent in the tick never drifts the
+        // schedule.
+        timespec_add_ns(&deadline, period_ns);
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long lag = timespec_diff_ns(&now, &deadline);
+        if (lag > 0) {
+            tick_stats.overruns++;
+            if (lag > tick_stats.worst_lag_ns) {
+                tick_stats.worst_lag_ns = lag;
+            }
+            // Late ticks run back to back to catch up, unless we are so far
+            // behind that a burst would be worse than dropping them.
+            if (lag > MAX_CATCHUP_TICKS * period_ns) {
+                long missed = lag / period_ns;
+                tick_stats.skipped += missed;
+                timespec_add_ns(&deadline, missed * period_ns);
+            }
+            continue;
+        }
+
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+    }
+    return NULL;
+}
+
+// Writes every counter as one JSON object. Rooms are locked one at a time
+// to list their clients, in the same order join_room() takes the locks.
+void write_stats(FILE* out) {
+    fprintf(out, "{\"uptime_ms\":%ld,\"transport\":\"%s\",\"tick_rate\":%d,", clock_ms() - started_ms,
+            udp_mode ? "udp" : "tcp", tick_rate);
+    fprintf(out, "\"ticks\":%lu,\"overruns\":%lu,\"skipped\":%lu,\"worst_lag_ns\":%ld,\"inputs_dropped\":%lu,"
+                 "\"inputs_limited\":%lu,",
+            __atomic_load_n(&tick_stats.ticks, __ATOMIC_RELAXED), __atomic_load_n(&tick_stats.overruns, __ATOMIC_RELAXED),
+            __atomic_load_n(&tick_stats.skipped, __ATOMIC_RELAXED),
+            __atomic_load_n(&tick_stats.worst_lag_ns, __ATOMIC_RELAXED),
+            __atomic_load_n(&inputs_dropped, __ATOMIC_RELAXED), __atomic_load_n(&inputs_limited, __ATOMIC_RELAXED));
+    fprintf(out, "\"outbound\":{\"frames_queued\":%lu,\"snapshots_dropped\":%lu,\"slow_disconnects\":%lu,"
+                 "\"max_queue_depth\":%d},",
+            __atomic_load_n(&outbound_stats.frames_queued, __ATOMIC_RELAXED),
+            __atomic_load_n(&outbound_stats.snapshots_dropped, __ATOMIC_RELAXED),
+            __atomic_load_n(&outbound_stats.slow_disconnects, __ATOMIC_RELAXED),
+            __atomic_load_n(&outbound_stats.max_queue_depth, __ATOMIC_RELAXED));
+    fprintf(out, "\"entities\":{\"players\":%d,\"bullets\":%d,\"ghosts\":%d},\"phases\":{",
+            __atomic_load_n(&entity_counts[ENTITY_PLAYER], __ATOMIC_RELAXED),
+            __atomic_load_n(&entity_counts[ENTITY_BULLET], __ATOMIC_RELAXED),
+            __atomic_load_n(&entity_counts[ENTITY_GHOST], __ATOMIC_RELAXED));
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        fprintf(out, "%s\"%s\":", p > 0 ? "," : "", phase_names[p]);
+        histogram_write_json(out, &phase_histograms[p]);
+    }
+    fprintf(out, "},");
+
+    pthread_mutex_lock(&rooms_mutex);
+    fprintf(out, "\"rooms\":%d,\"clients\":[", active_rooms);
+    int first = 1;
+    for (int r = 0; r < max_rooms; r++) {
+        Room* room = &rooms[r];
+        if (!room->active) {
             continue;
         }
+        pthread_mutex_lock(&room->mutex);
+        for (int i = 0; i < world_config.max_players; i++) {
+            Connection* connection = room->clients[i].connection;
+            if (connection == NULL) {
+                continue;
+            }
+            pthread_mutex_lock(&connection->out_mutex);
+            int queued_bytes = connection->out.bytes;
+            pthread_mutex_unlock(&connection->out_mutex);
+            fprintf(out, "%s{\"room\":%d,\"player\":%d,\"acked_tick\":%u,\"messages_sent\":%lu,"
+                         "\"bytes_sent\":%lu,\"queued_bytes\":%d}",
+                    first ? "" : ",", room->id, i + 1, room->clients[i].acked_tick,
+                    __atomic_load_n(&connection->messages_sent, __ATOMIC_RELAXED),
+                    __atomic_load_n(&connection->bytes_sent, __ATOMIC_RELAXED), queued_bytes);
+            first = 0;
+        }
+        pthread_mutex_unlock(&room->mutex);
+    }
+    pthread_mutex_unlock(&rooms_mutex);
+    fprintf(out, "]}\n");
+}
+
+// Answers every connection to the stats port with one JSON document and
+// closes it, so `nc 127.0.0.1 <port>` prints the current counters.
+void* stats_thread(void* arg) {
+    (void)arg;
+    while (1) {
+        int client = accept(stats_socket, NULL, NULL);
+        if (client < 0) {
+            if (errno != EINTR) {
+                perror("Stats accept failed");
+            }
+            continue;
+        }
+
+        char* text = NULL;
+        size_t len = 0;
+        FILE* out = open_memstream(&text, &len);
+        if (out != NULL) {
+            write_stats(out);
+            fclose(out);
+            for (size_t sent = 0; sent < len;) {
+                ssize_t n = send(client, text + sent, len - sent, MSG_NOSIGNAL);
+                if (n <= 0) {
+                    break;
+                }
+                sent += n;
+            }
+            free(text);
+        }
+        close(client);
+    }
+    return NULL;
+}
+
+void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-r tick_rate_hz] [-g ghost_interval_ticks] [-i io_threads] [-w worker_threads] [-m max_rooms]\n"
+                    "       [-W width] [-H height] [-p players_per_room] [-G max_ghosts] [-b bullets_per_player]\n"
+                    "       [-c fire_cooldown_ticks] [-a view_radius_cells] [-M stats_port] [-l inputs_per_tick]\n"
+                    "       [-S] [-u] [-s seed] [-R recording_prefix] [-P recording_to_replay] [-f map_file]\n", program);
+}
 
-        pthread_t thread_id;
-        pthread_create(&thread_id, NULL, handle_client, client_socket);
-        pthread_detach(thread_id);
+int main(int argc, char* argv[]) {
+    worker_threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (worker_threads <= 0) {
+        worker_threads = 1;
     }
 
+    base_seed = (uint64_t)time(NULL);
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:g:i:w:m:W:H:p:G:b:c:a:M:l:Sus:R:P:f:")) != -1) {
+        switch (opt) {
+            case 'r': tick_rate = atoi(optarg); break;
+            case 'g': ghost_interval = atoi(optarg); break;
+            case 'i': io_threads = atoi(optarg); break;
+            case 'w': worker_threads = atoi(optarg); break;
+            case 'm': max_rooms = atoi(optarg); break;
+            case 'W': world_config.width = atoi(optarg); break;
+            case 'H': world_config.height = atoi(optarg); break;
+            case 'p': world_config.max_players = atoi(optarg); break;
+            case 'G': world_config.max_ghosts = atoi(optarg); break;
+            case 'b': world_config.bullets_per_player = atoi(optarg); break;
+            case 'c': world_config.fire_cooldown = atoi(optarg); break;
+            case 'a': view_radius = atoi(optarg); break;
+            case 'M': stats_port = atoi(optarg); break;
+            case 'l': inputs_per_tick = atoi(optarg); break;
+            case 'S': kernels_set_simd(0); break;
+            case 'u': udp_mode = 1; break;
+            case 's': base_seed = strtoull(optarg, NULL, 10); break;
+            case 'R': record_prefix = optarg; break;
+            case 'P': replay_path = optarg; break;
+            case 'f': map_path = optarg; break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+
+    // A map decides the world's size.
+    if (map_path != NULL) {
+        if (map_load(&map, map_path) < 0) {
+            return 1;
+        }
+        world_config.width = map.width;
+        world_config.height = map.height;
+        world_config.map = &map;
+        printf("Playing on %s, %dx%d, checksum %08x\n", map_path, map.width, map.height, map.checksum);
+    }
+
+    // Replays need nothing from the network side and take their world
+    // settings from the recording.
+    if (replay_path != NULL) {
+        ReplayResult result;
+        int status = replay_file(replay_path, world_config.map, &result);
+        if (status < 0) {
+            return 1;
+        }
+        printf("Replayed %u ticks and %lu inputs in %.3f s (%.0f ticks/s)\n", result.ticks, result.inputs,
+               result.seconds, result.seconds > 0 ? result.ticks / result.seconds : 0.0);
+        if (status > 0) {
+            printf("%lu of %lu checksums differ, first at tick %u\n", result.mismatches, result.checksums,
+                   result.first_mismatch);
+            return 1;
+        }
+        printf("All %lu checksums match\n", result.checksums);
+        return 0;
+    }
+    if (tick_rate <= 0 || ghost_interval <= 0 || io_threads <= 0 || worker_threads <= 0 || max_rooms <= 0 ||
+        view_radius < 0 || stats_port < 0 || inputs_per_tick <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (world_config_validate(&world_config) < 0) {
+        fprintf(stderr, "World must be at most %dx%d (%d cells) with at most %d players, bullets and ghosts.\n",
+                MAX_GRID_SIDE, MAX_GRID_SIDE, MAX_GRID_CELLS, MAX_WORLD_ENTITIES);
+        return 1;
+    }
+
+    snapshot_capacity = snapshot_max_size(world_max_entities(&world_config));
+    tiles_across = (world_config.width + MAP_TILE_CELLS - 1) / MAP_TILE_CELLS;
+    tiles_down = (world_config.height + MAP_TILE_CELLS - 1) / MAP_TILE_CELLS;
+    tile_count = tiles_across * tiles_down;
+    tile_set_size = (tile_count + 7) / 8;
+    if (world_config.map != NULL && (shared_tiles = calloc(tile_count, sizeof(OutBuffer*))) == NULL) {
+        perror("Tile cache allocation failed");
+        return 1;
+    }
+    if (snapshot_capacity * OUT_QUEUE_MAX_SNAPSHOTS > out_queue_limit) {
+        out_queue_limit = snapshot_capacity * OUT_QUEUE_MAX_SNAPSHOTS;
+    }
+    // Snapshots are never split across datagrams.
+    if (udp_mode && snapshot_capacity > DATAGRAM_MAX_PAYLOAD) {
+        fprintf(stderr, "Snapshots of up to %d bytes do not fit in a datagram; use TCP or a smaller world.\n",
+                snapshot_capacity);
+        return 1;
+    }
+
+    raise_fd_limit();
+
+    rooms = calloc(max_rooms, sizeof(Room));
+    if (rooms == NULL) {
+        perror("Room allocation failed");
+        return 1;
+    }
+    for (int i = 0; i < max_rooms; i++) {
+        rooms[i].id = i + 1;
+        pthread_mutex_init(&rooms[i].mutex, NULL);
+    }
+
+    if (!udp_mode) {
+        server_socket = init_server_socket(DEFAULT_PORT);
+        set_nonblocking(server_socket);
+    }
+    printf("Server started on %s port %d at %d ticks/s with %d I/O threads, %d workers and up to %d rooms\n",
+           udp_mode ? "UDP" : "TCP", DEFAULT_PORT, tick_rate, io_threads, worker_threads, max_rooms);
+    printf("Rooms are %dx%d with %d players and %d ghosts, using %s kernels, base seed %llu\n", world_config.width,
+           world_config.height, world_config.max_players, world_config.max_ghosts,
+           kernels_simd_available() && kernels_simd_enabled() ? "SSE2" : "scalar", (unsigned long long)base_seed);
+
+    started_ms = clock_ms();
+    init_workers();
+
+    if (stats_port > 0) {
+        stats_socket = init_loopback_socket(stats_port);
+        if (stats_socket < 0) {
+            return 1;
+        }
+        pthread_t stats_tid;
+        pthread_create(&stats_tid, NULL, stats_thread, NULL);
+        pthread_detach(stats_tid);
+        printf("Serving stats as JSON on 127.0.0.1 port %d\n", stats_port);
+    }
+
+    pthread_t simulation_tid;
+    pthread_create(&simulation_tid, NULL, simulation_thread, NULL);
+
+    reactors = calloc(io_threads, sizeof(Reactor));
+    for (int i = 0; i < io_threads; i++) {
+        init_reactor(&reactors[i]);
+    }
+    for (int i = 1; i < io_threads; i++) {
+        pthread_t reactor_tid;
+        pthread_create(&reactor_tid, NULL, reactor_thread, &reactors[i]);
+        pthread_detach(reactor_tid);
+    }
+    reactor_thread(&reactors[0]);
+
     close(server_socket);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,160 @@
+#include "kernels.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static int use_simd = 1;
+
+int kernels_simd_available(void) {
+#ifdef __SSE2__
+    return 1;
+#else
+    return 0;
+#endif
+}
+
+void kernels_set_simd(int enabled) {
+    use_simd = enabled;
+}
+
+int kernels_simd_enabled(void) {
+    return use_simd;
+}
+
+// Distances as signed values so SSE2 can compare them; unreachable and
+// off-grid cells compare greater than anything reachable.
+static int32_t field_at(const uint32_t* distance, int cell) {
+    uint32_t d = distance[cell];
+    return d > INT32_MAX ? INT32_MAX : (int32_t)d;
+}
+
+static void advance_scalar(const int32_t* x, const int32_t* y, const int32_t* dx, const int32_t* dy, int start,
+                           int count, int width, int height, int32_t* cells) {
+    for (int i = start; i < count; i++) {
+        int nx = x[i] + dx[i];
+        int ny = y[i] + dy[i];
+        cells[i] = (nx >= 0 && nx < width && ny >= 0 && ny < height) ? ny * width + nx : -1;
+    }
+}
+
+static void ghost_steps_scalar(int32_t* x, int32_t* y, int start, int count, int width, int height,
+                               const uint32_t* distance) {
+    for (int i = start; i < count; i++) {
+        int c = y[i] * width + x[i];
+        int32_t best = field_at(distance, c);
+        int step_x = 0, step_y = 0;
+        if (y[i] > 0 && field_at(distance, c - width) < best) {
+            best = field_at(distance, c - width);
+            step_x = 0;
+            step_y = -1;
+        }
+        if (y[i] < height - 1 && field_at(distance, c + width) < best) {
+            best = field_at(distance, c + width);
+            step_x = 0;
+            step_y = 1;
+        }
+        if (x[i] > 0 && field_at(distance, c - 1) < best) {
+            best = field_at(distance, c - 1);
+            step_x = -1;
+            step_y = 0;
+        }
+        if (x[i] < width - 1 && field_at(distance, c + 1) < best) {
+            step_x = 1;
+            step_y = 0;
+        }
+        x[i] += step_x;
+        y[i] += step_y;
+    }
+}
+
+#ifdef __SSE2__
+// SSE2 has no 32-bit low multiply; build it from the two 32x32->64 ones.
+static __m128i mullo_epi32(__m128i a, __m128i b) {
+    __m128i even = _mm_mul_epu32(a, b);
+    __m128i odd = _mm_mul_epu32(_mm_srli_si128(a, 4), _mm_srli_si128(b, 4));
+    return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)),
+                              _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+static __m128i select_epi32(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static int advance_sse2(const int32_t* x, const int32_t* y, const int32_t* dx, const int32_t* dy, int count,
+                        int width, int height, int32_t* cells) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i off_grid = _mm_set1_epi32(-1);
+    const __m128i w = _mm_set1_epi32(width);
+    const __m128i h = _mm_set1_epi32(height);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128i nx = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(x + i)), _mm_loadu_si128((const __m128i*)(dx + i)));
+        __m128i ny = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(y + i)), _mm_loadu_si128((const __m128i*)(dy + i)));
+        __m128i outside = _mm_or_si128(_mm_cmplt_epi32(nx, zero), _mm_cmplt_epi32(ny, zero));
+        __m128i inside = _mm_andnot_si128(outside, _mm_and_si128(_mm_cmplt_epi32(nx, w), _mm_cmplt_epi32(ny, h)));
+        __m128i cell = _mm_add_epi32(mullo_epi32(ny, w), nx);
+        _mm_storeu_si128((__m128i*)(cells + i), select_epi32(inside, cell, off_grid));
+    }
+    return i;
+}
+
+static int ghost_steps_sse2(int32_t* x, int32_t* y, int count, int width, int height, const uint32_t* distance) {
+    int32_t around[5][4];
+    const __m128i step_x[5] = {_mm_setzero_si128(), _mm_setzero_si128(), _mm_setzero_si128(),
+                               _mm_set1_epi32(-1), _mm_set1_epi32(1)};
+    const __m128i step_y[5] = {_mm_setzero_si128(), _mm_set1_epi32(-1), _mm_set1_epi32(1),
+                               _mm_setzero_si128(), _mm_setzero_si128()};
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        // Gathers are scalar on SSE2; the selection below is not.
+        for (int lane = 0; lane < 4; lane++) {
+            int gx = x[i + lane], gy = y[i + lane];
+            int c = gy * width + gx;
+            around[0][lane] = field_at(distance, c);
+            around[1][lane] = gy > 0 ? field_at(distance, c - width) : INT32_MAX;
+            around[2][lane] = gy < height - 1 ? field_at(distance, c + width) : INT32_MAX;
+            around[3][lane] = gx > 0 ? field_at(distance, c - 1) : INT32_MAX;
+            around[4][lane] = gx < width - 1 ? field_at(distance, c + 1) : INT32_MAX;
+        }
+
+        __m128i best = _mm_loadu_si128((const __m128i*)around[0]);
+        __m128i move_x = step_x[0];
+        __m128i move_y = step_y[0];
+        for (int n = 1; n < 5; n++) {
+            __m128i candidate = _mm_loadu_si128((const __m128i*)around[n]);
+            __m128i closer = _mm_cmplt_epi32(candidate, best);
+            best = select_epi32(closer, candidate, best);
+            move_x = select_epi32(closer, step_x[n], move_x);
+            move_y = select_epi32(closer, step_y[n], move_y);
+        }
+
+        __m128i* px = (__m128i*)(x + i);
+        __m128i* py = (__m128i*)(y + i);
+        _mm_storeu_si128(px, _mm_add_epi32(_mm_loadu_si128(px), move_x));
+        _mm_storeu_si128(py, _mm_add_epi32(_mm_loadu_si128(py), move_y));
+    }
+    return i;
+}
+#endif
+
+void kernel_advance(const int32_t* x, const int32_t* y, const int32_t* dx, const int32_t* dy, int count,
+                    int width, int height, int32_t* cells) {
+    int done = 0;
+#ifdef __SSE2__
+    if (use_simd) {
+        done = advance_sse2(x, y, dx, dy, count, width, height, cells);
+    }
+#endif
+    advance_scalar(x, y, dx, dy, done, count, width, height, cells);
+}
+
+void kernel_ghost_steps(int32_t* x, int32_t* y, int count, int width, int height, const uint32_t* distance) {
+    int done = 0;
+#ifdef __SSE2__
+    if (use_simd) {
+        done = ghost_steps_sse2(x, y, count, width, height, distance);
+    }
+#endif
+    ghost_steps_scalar(x, y, done, count, width, height, distance);
+}
@@ -0,0 +1,61 @@
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stdint.h>
+
+// Batch kernels over structure-of-arrays entity columns. Each has an SSE2
+// version, used when the compiler targets SSE2 and SIMD is enabled, and a
+// scalar version that produces identical results.
+
+/**
+ * @brief Report whether the SIMD kernels were compiled in.
+ *
+ * @return 1 if SSE2 kernels are available, 0 otherwise.
+ */
+int kernels_simd_available(void);
+
+/**
+ * @brief Choose between the SIMD and scalar kernels at runtime.
+ *
+ * @param enabled Non-zero to use SIMD when available, 0 to force scalar.
+ */
+void kernels_set_simd(int enabled);
+
+/**
+ * @brief Report the runtime SIMD setting.
+ *
+ * @return 1 unless kernels_set_simd(0) was called.
+ */
+int kernels_simd_enabled(void);
+
+/**
+ * @brief Move entities one step and resolve their cells.
+ *
+ * @param x Column of x coordinates.
+ * @param y Column of y coordinates.
+ * @param dx Column of x velocities.
+ * @param dy Column of y velocities.
+ * @param count Number of entities.
+ * @param width The grid width.
+ * @param height The grid height.
+ * @param cells Receives the row-major cell of (x + dx, y + dy), or -1 if that is off the grid.
+ */
+void kernel_advance(const int32_t* x, const int32_t* y, const int32_t* dx, const int32_t* dy, int count,
+                    int width, int height, int32_t* cells);
+
+/**
+ * @brief Pick each ghost's next cell from a distance field.
+ *
+ * A ghost moves to whichever neighbour (up, down, left, right, first wins
+ * on ties) has a strictly smaller distance than its own cell, or stays.
+ *
+ * @param x Column of x coordinates, updated in place.
+ * @param y Column of y coordinates, updated in place.
+ * @param count Number of ghosts.
+ * @param width The grid width.
+ * @param height The grid height.
+ * @param distance Row-major distance field; UINT32_MAX marks unreachable cells.
+ */
+void kernel_ghost_steps(int32_t* x, int32_t* y, int count, int width, int height, const uint32_t* distance);
+
+#endif // KERNELS_H
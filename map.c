@@ -0,0 +1,343 @@
+#include "map.h"
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_THREADS 64
+#define NO_LABEL UINT32_MAX
+
+static void put_u16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_u32(uint8_t* p, uint32_t v) {
+    put_u16(p, (uint16_t)v);
+    put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put_u64(uint8_t* p, uint64_t v) {
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t get_u16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return (uint32_t)get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t* p) {
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+uint32_t map_checksum(const uint8_t* cells, int width, int height) {
+    uint32_t hash = 2166136261u;
+    size_t count = (size_t)width * height;
+    for (size_t i = 0; i < count; i++) {
+        hash = (hash ^ cells[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Shared by every thread working on one map_generate() call.
+typedef struct Generation Generation;
+struct Generation {
+    uint8_t* cells;
+    int width;
+    int height;
+    uint64_t seed;
+    uint32_t* labels;   // per cell: its chunk-local component, NO_LABEL for walls
+    uint32_t* parents;  // union-find links between labels
+    int chunks_across;
+    int chunk_count;
+    int next_chunk;     // atomic, next chunk to hand out
+    uint32_t main;      // root of the outer ring's component
+    long filled;        // atomic
+    void (*phase)(Generation*, int);
+};
+
+// splitmix64 of the seed and chunk feeding xorshift64*, as in world.c.
+static uint64_t chunk_random_state(uint64_t seed, int chunk) {
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull * (uint64_t)(chunk + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    return z != 0 ? z : 1;
+}
+
+static uint32_t next_random(uint64_t* state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return (uint32_t)((x * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+static void chunk_bounds(const Generation* gen, int chunk, int* x0, int* y0, int* x1, int* y1) {
+    *x0 = chunk % gen->chunks_across * MAP_CHUNK_CELLS;
+    *y0 = chunk / gen->chunks_across * MAP_CHUNK_CELLS;
+    *x1 = *x0 + MAP_CHUNK_CELLS < gen->width ? *x0 + MAP_CHUNK_CELLS : gen->width;
+    *y1 = *y0 + MAP_CHUNK_CELLS < gen->height ? *y0 + MAP_CHUNK_CELLS : gen->height;
+}
+
+// Rolls the chunk's walls, then flood-fills its open cells. Each
+// component is labelled with the index of its first cell, so labels are
+// unique across chunks without any coordination.
+static void place_and_label(Generation* gen, int chunk) {
+    int x0, y0, x1, y1;
+    chunk_bounds(gen, chunk, &x0, &y0, &x1, &y1);
+    int width = gen->width;
+    uint64_t state = chunk_random_state(gen->seed, chunk);
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            int border = x == 0 || y == 0 || x == width - 1 || y == gen->height - 1;
+            int wall = next_random(&state) % 100 < MAP_WALL_PERCENT;
+            gen->cells[(size_t)y * width + x] = !border && wall;
+            gen->labels[(size_t)y * width + x] = NO_LABEL;
+        }
+    }
+
+    uint32_t queue[MAP_CHUNK_CELLS * MAP_CHUNK_CELLS];
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            uint32_t first = (uint32_t)((size_t)y * width + x);
+            if (gen->cells[first] || gen->labels[first] != NO_LABEL) {
+                continue;
+            }
+            gen->labels[first] = first;
+            gen->parents[first] = first;
+            int head = 0, tail = 0;
+            queue[tail++] = first;
+            while (head < tail) {
+                uint32_t cell = queue[head++];
+                int cx = (int)(cell % width), cy = (int)(cell / width);
+                int nx[4] = {cx - 1, cx + 1, cx, cx};
+                int ny[4] = {cy, cy, cy - 1, cy + 1};
+                for (int n = 0; n < 4; n++) {
+                    if (nx[n] < x0 || nx[n] >= x1 || ny[n] < y0 || ny[n] >= y1) {
+                        continue;
+                    }
+                    uint32_t next = (uint32_t)((size_t)ny[n] * width + nx[n]);
+                    if (!gen->cells[next] && gen->labels[next] == NO_LABEL) {
+                        gen->labels[next] = first;
+                        queue[tail++] = next;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static uint32_t find_root(uint32_t* parents, uint32_t label) {
+    while (parents[label] != label) {
+        parents[label] = parents[parents[label]];
+        label = parents[label];
+    }
+    return label;
+}
+
+// Read-only, for the fill phase where threads share the links.
+static uint32_t root_of(const uint32_t* parents, uint32_t label) {
+    while (parents[label] != label) {
+        label = parents[label];
+    }
+    return label;
+}
+
+static void join_cells(Generation* gen, size_t a, size_t b) {
+    if (gen->cells[a] || gen->cells[b]) {
+        return;
+    }
+    uint32_t root_a = find_root(gen->parents, gen->labels[a]);
+    uint32_t root_b = find_root(gen->parents, gen->labels[b]);
+    // The lower label wins so the result does not depend on edge order.
+    if (root_a < root_b) {
+        gen->parents[root_b] = root_a;
+    } else if (root_b < root_a) {
+        gen->parents[root_a] = root_b;
+    }
+}
+
+static void fill_pockets(Generation* gen, int chunk) {
+    int x0, y0, x1, y1;
+    chunk_bounds(gen, chunk, &x0, &y0, &x1, &y1);
+    long filled = 0;
+    uint32_t last_label = NO_LABEL, last_root = 0;
+    for (int y = y0; y < y1; y++) {
+        for (int x = x0; x < x1; x++) {
+            size_t cell = (size_t)y * gen->width + x;
+            if (gen->cells[cell]) {
+                continue;
+            }
+            if (gen->labels[cell] != last_label) {
+                last_label = gen->labels[cell];
+                last_root = root_of(gen->parents, last_label);
+            }
+            if (last_root != gen->main) {
+                gen->cells[cell] = 1;
+                filled++;
+            }
+        }
+    }
+    __atomic_add_fetch(&gen->filled, filled, __ATOMIC_RELAXED);
+}
+
+static void* run_phase(void* arg) {
+    Generation* gen = arg;
+    int chunk;
+    while ((chunk = __atomic_fetch_add(&gen->next_chunk, 1, __ATOMIC_RELAXED)) < gen->chunk_count) {
+        gen->phase(gen, chunk);
+    }
+    return NULL;
+}
+
+// The caller works too, so a thread that fails to start only costs speed.
+static void run_parallel(Generation* gen, void (*phase)(Generation*, int), int threads) {
+    pthread_t workers[MAX_THREADS];
+    gen->phase = phase;
+    gen->next_chunk = 0;
+    int started = 0;
+    while (started < threads - 1 && pthread_create(&workers[started], NULL, run_phase, gen) == 0) {
+        started++;
+    }
+    run_phase(gen);
+    for (int i = 0; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+}
+
+long map_generate(uint8_t* cells, int width, int height, uint64_t seed, int threads, uint32_t* labels,
+                  uint32_t* parents) {
+    Generation gen;
+    memset(&gen, 0, sizeof(gen));
+    gen.cells = cells;
+    gen.width = width;
+    gen.height = height;
+    gen.seed = seed;
+    gen.labels = labels;
+    gen.parents = parents;
+    gen.chunks_across = (width + MAP_CHUNK_CELLS - 1) / MAP_CHUNK_CELLS;
+    gen.chunk_count = gen.chunks_across * ((height + MAP_CHUNK_CELLS - 1) / MAP_CHUNK_CELLS);
+    if (threads > gen.chunk_count) {
+        threads = gen.chunk_count;
+    }
+    if (threads > MAX_THREADS) {
+        threads = MAX_THREADS;
+    }
+
+    run_parallel(&gen, place_and_label, threads);
+
+    // Components that touch across a chunk edge are one component.
+    for (int x = MAP_CHUNK_CELLS; x < width; x += MAP_CHUNK_CELLS) {
+        for (int y = 0; y < height; y++) {
+            join_cells(&gen, (size_t)y * width + x - 1, (size_t)y * width + x);
+        }
+    }
+    for (int y = MAP_CHUNK_CELLS; y < height; y += MAP_CHUNK_CELLS) {
+        for (int x = 0; x < width; x++) {
+            join_cells(&gen, (size_t)(y - 1) * width + x, (size_t)y * width + x);
+        }
+    }
+
+    // The outer ring is always open, so it is one component and the one
+    // the rest of the map must reach.
+    gen.main = find_root(parents, labels[0]);
+    run_parallel(&gen, fill_pockets, threads);
+    return gen.filled;
+}
+
+int map_save(const char* path, const uint8_t* cells, int width, int height, uint64_t seed) {
+    size_t count = (size_t)width * height;
+    uint32_t walls = 0;
+    for (size_t i = 0; i < count; i++) {
+        walls += cells[i] != 0;
+    }
+
+    uint8_t header[MAP_HEADER_SIZE] = {0};
+    put_u32(header, MAP_MAGIC);
+    put_u16(header + 4, MAP_VERSION);
+    put_u16(header + 8, (uint16_t)width);
+    put_u16(header + 10, (uint16_t)height);
+    put_u32(header + 12, walls);
+    put_u64(header + 16, seed);
+    put_u32(header + 24, map_checksum(cells, width, height));
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL) {
+        perror("Cannot create map");
+        return -1;
+    }
+    int failed = fwrite(header, sizeof(header), 1, file) != 1 || fwrite(cells, 1, count, file) != count;
+    if (fclose(file) != 0 || failed) {
+        perror("Cannot write map");
+        return -1;
+    }
+    return 0;
+}
+
+int map_load(Map* map, const char* path) {
+    memset(map, 0, sizeof(*map));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        perror("Cannot open map");
+        return -1;
+    }
+    struct stat info;
+    if (fstat(fd, &info) < 0 || info.st_size < MAP_HEADER_SIZE) {
+        fprintf(stderr, "%s is not a map this build can load.\n", path);
+        close(fd);
+        return -1;
+    }
+    void* mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        perror("Cannot map map file");
+        return -1;
+    }
+
+    const uint8_t* data = mapping;
+    int width = get_u16(data + 8);
+    int height = get_u16(data + 10);
+    if (get_u32(data) != MAP_MAGIC || get_u16(data + 4) != MAP_VERSION || width == 0 || height == 0 ||
+        (size_t)info.st_size != MAP_HEADER_SIZE + (size_t)width * height) {
+        fprintf(stderr, "%s is not a map this build can load.\n", path);
+        munmap(mapping, (size_t)info.st_size);
+        return -1;
+    }
+    const uint8_t* cells = data + MAP_HEADER_SIZE;
+    size_t count = (size_t)width * height;
+    size_t i = 0;
+    while (i < count && cells[i] <= 1) {
+        i++;
+    }
+    if (i < count || map_checksum(cells, width, height) != get_u32(data + 24)) {
+        fprintf(stderr, "%s is corrupt.\n", path);
+        munmap(mapping, (size_t)info.st_size);
+        return -1;
+    }
+
+    map->cells = cells;
+    map->width = width;
+    map->height = height;
+    map->seed = get_u64(data + 16);
+    map->checksum = get_u32(data + 24);
+    map->mapping = mapping;
+    map->mapping_size = (size_t)info.st_size;
+    return 0;
+}
+
+void map_unload(Map* map) {
+    if (map->mapping != NULL) {
+        munmap(map->mapping, map->mapping_size);
+        map->mapping = NULL;
+        map->cells = NULL;
+    }
+}
@@ -0,0 +1,94 @@
+#ifndef MAP_H
+#define MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Map file format (all integers little-endian):
+//   header: magic u32, version u16, reserved u16, width u16, height u16,
+//           walls u32, seed u64, checksum u32, reserved u32 x 2
+//   cells : width * height bytes, row-major, 1 for a wall and 0 otherwise
+// The cells are laid out exactly as a world reads them, so a loaded map is
+// used straight from its read-only mapping and every room shares its pages.
+// checksum is map_checksum() of the cells.
+#define MAP_MAGIC 0x50414D42  // "BMAP"
+#define MAP_VERSION 1
+#define MAP_HEADER_SIZE 32
+
+// Generation works on square chunks of this many cells, each seeded on
+// its own, so a map depends only on its seed and size, never on how many
+// threads built it.
+#define MAP_CHUNK_CELLS 64
+#define MAP_WALL_PERCENT 20
+
+typedef struct {
+    const uint8_t* cells;  // width * height, row-major, 1 for walls
+    int width;
+    int height;
+    uint64_t seed;
+    uint32_t checksum;
+    void* mapping;
+    size_t mapping_size;
+} Map;
+
+/**
+ * @brief Hash a wall layout.
+ *
+ * @param cells Row-major cells.
+ * @param width The map width in cells.
+ * @param height The map height in cells.
+ * @return The 32-bit FNV-1a hash of the cells.
+ */
+uint32_t map_checksum(const uint8_t* cells, int width, int height);
+
+/**
+ * @brief Generate a seeded wall layout in which every open cell can reach
+ *        every other.
+ *
+ * Interior cells become walls with MAP_WALL_PERCENT probability; the outer
+ * ring stays open. Open cells are then labelled chunk by chunk, the labels
+ * joined across chunk edges, and every pocket cut off from the outer ring
+ * is filled in. Nothing is allocated.
+ *
+ * @param cells Receives width * height row-major cells.
+ * @param width The map width in cells.
+ * @param height The map height in cells.
+ * @param seed The seed; the same seed and size give the same map.
+ * @param threads Threads to spread chunks over; 1 runs on the caller.
+ * @param labels Scratch, width * height entries.
+ * @param parents Scratch, width * height entries.
+ * @return The number of pocket cells filled.
+ */
+long map_generate(uint8_t* cells, int width, int height, uint64_t seed, int threads, uint32_t* labels,
+                  uint32_t* parents);
+
+/**
+ * @brief Write a map file.
+ *
+ * @param path The file to create.
+ * @param cells Row-major cells, 1 for walls.
+ * @param width The map width in cells.
+ * @param height The map height in cells.
+ * @param seed The seed it was generated from, kept for reference.
+ * @return 0 on success, or -1 if the file could not be written.
+ */
+int map_save(const char* path, const uint8_t* cells, int width, int height, uint64_t seed);
+
+/**
+ * @brief Map a map file read-only and validate it.
+ *
+ * @param map Filled with the layout, which points into the mapping.
+ * @param path The file to open.
+ * @return 0 on success, or -1 if the file is missing, of another version
+ *         or corrupt.
+ */
+int map_load(Map* map, const char* path);
+
+/**
+ * @brief Unmap a map loaded with map_load().
+ *
+ * @param map The map; its cells must no longer be in use.
+ */
+void map_unload(Map* map);
+
+#endif // MAP_H
@@ -0,0 +1,73 @@
+#include "map.h"
+#include "profile.h"
+#include "world.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_MAP_SIDE 1024
+
+void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-W width] [-H height] [-s seed] [-t threads] <map_file>\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    int width = DEFAULT_MAP_SIDE;
+    int height = DEFAULT_MAP_SIDE;
+    uint64_t seed = (uint64_t)time(NULL);
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads <= 0) {
+        threads = 1;
+    }
+
+    int opt;
+    while ((opt = getopt(argc, argv, "W:H:s:t:")) != -1) {
+        switch (opt) {
+            case 'W': width = atoi(optarg); break;
+            case 'H': height = atoi(optarg); break;
+            case 's': seed = strtoull(optarg, NULL, 10); break;
+            case 't': threads = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc - 1 || threads <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (width <= 0 || height <= 0 || width > MAX_GRID_SIDE || height > MAX_GRID_SIDE ||
+        (long)width * height > MAX_GRID_CELLS) {
+        fprintf(stderr, "Maps must be at most %dx%d (%d cells).\n", MAX_GRID_SIDE, MAX_GRID_SIDE, MAX_GRID_CELLS);
+        return 1;
+    }
+
+    size_t cells = (size_t)width * height;
+    uint8_t* walls = malloc(cells);
+    uint32_t* labels = malloc(cells * sizeof(uint32_t));
+    uint32_t* parents = malloc(cells * sizeof(uint32_t));
+    if (walls == NULL || labels == NULL || parents == NULL) {
+        perror("Map allocation failed");
+        return 1;
+    }
+
+    long start = clock_ns();
+    long filled = map_generate(walls, width, height, seed, threads, labels, parents);
+    double ms = (clock_ns() - start) / 1e6;
+    free(labels);
+    free(parents);
+
+    size_t wall_count = 0;
+    for (size_t i = 0; i < cells; i++) {
+        wall_count += walls[i];
+    }
+    printf("Generated a %dx%d map from seed %llu on %d threads in %.1f ms\n", width, height,
+           (unsigned long long)seed, threads, ms);
+    printf("%zu walls, %ld of them filled pockets, checksum %08x\n", wall_count, filled,
+           map_checksum(walls, width, height));
+
+    int status = map_save(argv[optind], walls, width, height, seed);
+    free(walls);
+    return status < 0 ? 1 : 0;
+}
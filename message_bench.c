@@ -0,0 +1,129 @@
+#include "sock.h"
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define DEFAULT_MESSAGES 4096
+#define DEFAULT_ROUNDS 2000
+
+// A server's inbound traffic: mostly moves and acks, some shots.
+typedef struct {
+    uint8_t text[48];
+    int len;
+} Sample;
+
+Sample* samples = NULL;
+int sample_count = DEFAULT_MESSAGES;
+int rounds = DEFAULT_ROUNDS;
+
+void make_samples(void) {
+    unsigned int seed = 1;
+    for (int i = 0; i < sample_count; i++) {
+        Sample* sample = &samples[i];
+        int kind = rand_r(&seed) % 10;
+        char direction = "UDLR"[rand_r(&seed) % 4];
+        if (kind < 6) {
+            sample->len = snprintf((char*)sample->text, sizeof(sample->text), "ACTION:MOVE:1:%c:%u", direction,
+                                   (unsigned)(i % 65535 + 1));
+        } else if (kind < 7) {
+            sample->len = snprintf((char*)sample->text, sizeof(sample->text), "ACTION:SHOOT:%c", direction);
+        } else {
+            sample->len = snprintf((char*)sample->text, sizeof(sample->text), "ACK:%u", (unsigned)(i * 3 + 1));
+        }
+    }
+}
+
+// The strncmp and sscanf dispatch the server used before message_parse().
+// Each call folds what it decoded into a sum so the two paths can be
+// compared and neither is optimized away.
+long parse_scanf(const uint8_t* payload, int len) {
+    char command[BUFFER_SIZE];
+    memcpy(command, payload, len);
+    command[len] = '\0';
+
+    if (strncmp(command, "ACK:", 4) == 0) {
+        unsigned int tick = 0;
+        sscanf(command + 4, "%u", &tick);
+        return tick;
+    } else if (strncmp(command, "ACTION:MOVE:", 12) == 0) {
+        int steps = 1;
+        char direction = '\0';
+        unsigned int seq = 0;
+        sscanf(command + 12, "%d:%c:%u", &steps, &direction, &seq);
+        return steps + direction + seq;
+    } else if (strncmp(command, "ACTION:SHOOT:", 13) == 0) {
+        char direction = '\0';
+        sscanf(command + 13, "%c", &direction);
+        return direction;
+    }
+    return 0;
+}
+
+long parse_table(const uint8_t* payload, int len) {
+    Message message;
+    if (message_parse(payload, len, &message) < 0) {
+        return 0;
+    }
+    switch (message.type) {
+        case MESSAGE_ACK: return message.fields[0];
+        case MESSAGE_MOVE: return message.fields[0] + message.fields[1] + message.fields[2];
+        case MESSAGE_SHOOT: return message.fields[0];
+        default: return 0;
+    }
+}
+
+double run(const char* name, long (*parse)(const uint8_t*, int), long* sum) {
+    *sum = 0;
+    long start = clock_ns();
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < sample_count; i++) {
+            *sum += parse(samples[i].text, samples[i].len);
+        }
+    }
+    double ns = (double)(clock_ns() - start) / ((double)rounds * sample_count);
+    printf("%-8s %8.1f ns/message %12.0f messages/s\n", name, ns, 1e9 / ns);
+    return ns;
+}
+
+void usage(const char* program) {
+    fprintf(stderr, "Usage: %s [-n messages] [-r rounds]\n", program);
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+        switch (opt) {
+            case 'n': sample_count = atoi(optarg); break;
+            case 'r': rounds = atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return 1;
+        }
+    }
+    if (optind != argc || sample_count <= 0 || rounds <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    samples = malloc((size_t)sample_count * sizeof(Sample));
+    if (samples == NULL) {
+        perror("Sample allocation failed");
+        return 1;
+    }
+    make_samples();
+
+    long scanf_sum;
+    long table_sum;
+    double scanf_ns = run("sscanf", parse_scanf, &scanf_sum);
+    double table_ns = run("table", parse_table, &table_sum);
+    printf("speedup  %8.1fx\n", scanf_ns / table_ns);
+
+    free(samples);
+    if (scanf_sum != table_sum) {
+        fprintf(stderr, "The parsers disagree: %ld vs %ld\n", scanf_sum, table_sum);
+        return 1;
+    }
+    return 0;
+}
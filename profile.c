@@ -0,0 +1,54 @@
+#include "profile.h"
+#include <time.h>
+
+long clock_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+void histogram_add(Histogram* histogram, long ns) {
+    if (ns < 0) {
+        ns = 0;
+    }
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzl((unsigned long)ns);
+    if (bucket >= HISTOGRAM_BUCKETS) {
+        bucket = HISTOGRAM_BUCKETS - 1;
+    }
+
+    __atomic_add_fetch(&histogram->counts[bucket], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->total, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&histogram->sum_ns, (unsigned long)ns, __ATOMIC_RELAXED);
+    long seen = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (ns > seen &&
+           !__atomic_compare_exchange_n(&histogram->max_ns, &seen, ns, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+long histogram_percentile(const Histogram* histogram, double fraction) {
+    unsigned long total = __atomic_load_n(&histogram->total, __ATOMIC_RELAXED);
+    if (total == 0) {
+        return 0;
+    }
+    unsigned long target = (unsigned long)(total * fraction);
+    unsigned long seen = 0;
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        seen += __atomic_load_n(&histogram->counts[b], __ATOMIC_RELAXED);
+        if (seen > target) {
+            return b == 0 ? 0 : 1L << b;
+        }
+    }
+    return __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+}
+
+void histogram_write_json(FILE* out, const Histogram* histogram) {
+    unsigned long total = __atomic_load_n(&histogram->total, __ATOMIC_RELAXED);
+    unsigned long sum_ns = __atomic_load_n(&histogram->sum_ns, __ATOMIC_RELAXED);
+    fprintf(out, "{\"count\":%lu,\"mean_ns\":%lu,\"max_ns\":%ld,\"p50_ns\":%ld,\"p90_ns\":%ld,\"p99_ns\":%ld,\"buckets\":[",
+            total, total > 0 ? sum_ns / total : 0, __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED),
+            histogram_percentile(histogram, 0.50), histogram_percentile(histogram, 0.90),
+            histogram_percentile(histogram, 0.99));
+    for (int b = 0; b < HISTOGRAM_BUCKETS; b++) {
+        fprintf(out, "%s%lu", b > 0 ? "," : "", __atomic_load_n(&histogram->counts[b], __ATOMIC_RELAXED));
+    }
+    fprintf(out, "]}");
+}
@@ -0,0 +1,54 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+
+// Durations are counted in power-of-two buckets of nanoseconds: bucket 0
+// holds zero, bucket b holds [2^(b-1), 2^b) ns and the last one
+// everything longer. Any thread may add to a histogram at any time.
+#define HISTOGRAM_BUCKETS 40
+
+typedef struct {
+    unsigned long counts[HISTOGRAM_BUCKETS];
+    unsigned long total;
+    unsigned long sum_ns;
+    long max_ns;
+} Histogram;
+
+/**
+ * @brief Read the monotonic clock.
+ *
+ * @return Nanoseconds since an arbitrary fixed point.
+ */
+long clock_ns(void);
+
+/**
+ * @brief Count one duration.
+ *
+ * @param histogram The histogram to add to.
+ * @param ns The duration in nanoseconds.
+ */
+void histogram_add(Histogram* histogram, long ns);
+
+/**
+ * @brief Estimate a percentile from the bucket counts.
+ *
+ * @param histogram The histogram to read.
+ * @param fraction The percentile as a fraction, e.g. 0.99.
+ * @return The upper bound of the bucket holding it in nanoseconds, or 0
+ *         if nothing has been counted.
+ */
+long histogram_percentile(const Histogram* histogram, double fraction);
+
+/**
+ * @brief Write a histogram as a JSON object.
+ *
+ * The object has count, mean_ns, max_ns, p50_ns, p90_ns, p99_ns and the
+ * raw buckets.
+ *
+ * @param out The stream to write to.
+ * @param histogram The histogram to write.
+ */
+void histogram_write_json(FILE* out, const Histogram* histogram);
+
+#endif // PROFILE_H
@@ -0,0 +1,232 @@
+#include "replay.h"
+#include "profile.h"
+#include <stdlib.h>
+#include <string.h>
+
+static void put_u16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_u32(uint8_t* p, uint32_t v) {
+    put_u16(p, (uint16_t)v);
+    put_u16(p + 2, (uint16_t)(v >> 16));
+}
+
+static void put_u64(uint8_t* p, uint64_t v) {
+    put_u32(p, (uint32_t)v);
+    put_u32(p + 4, (uint32_t)(v >> 32));
+}
+
+static uint16_t get_u16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return (uint32_t)get_u16(p) | ((uint32_t)get_u16(p + 2) << 16);
+}
+
+static uint64_t get_u64(const uint8_t* p) {
+    return (uint64_t)get_u32(p) | ((uint64_t)get_u32(p + 4) << 32);
+}
+
+int recorder_open(Recorder* recorder, const char* path, const WorldConfig* config, uint64_t seed,
+                  int ghost_interval) {
+    recorder->file = fopen(path, "wb");
+    if (recorder->file == NULL) {
+        perror("Recording failed");
+        return -1;
+    }
+
+    uint8_t header[RECORDING_HEADER_SIZE] = {0};
+    put_u32(header, RECORDING_MAGIC);
+    put_u16(header + 4, RECORDING_VERSION);
+    put_u16(header + 6, (uint16_t)ghost_interval);
+    put_u64(header + 8, seed);
+    put_u16(header + 16, (uint16_t)config->width);
+    put_u16(header + 18, (uint16_t)config->height);
+    put_u16(header + 20, (uint16_t)config->max_players);
+    put_u16(header + 22, (uint16_t)config->max_ghosts);
+    put_u16(header + 24, (uint16_t)config->bullets_per_player);
+    put_u16(header + 26, (uint16_t)config->fire_cooldown);
+    put_u32(header + 28, config->map != NULL ? config->map->checksum : 0);
+    if (fwrite(header, sizeof(header), 1, recorder->file) != 1) {
+        perror("Recording failed");
+        recorder_close(recorder);
+        return -1;
+    }
+    return 0;
+}
+
+// A recording that cannot be written is abandoned rather than left with
+// a gap that would make it replay wrongly.
+static void write_record(Recorder* recorder, uint32_t tick, RecordType type, int slot, char direction,
+                         uint64_t value) {
+    if (recorder->file == NULL) {
+        return;
+    }
+    uint8_t record[RECORDING_RECORD_SIZE] = {0};
+    put_u32(record, tick);
+    record[4] = (uint8_t)type;
+    record[5] = (uint8_t)slot;
+    record[6] = (uint8_t)direction;
+    put_u64(record + 8, value);
+    if (fwrite(record, sizeof(record), 1, recorder->file) != 1) {
+        perror("Recording failed");
+        recorder_close(recorder);
+    }
+}
+
+void recorder_join(Recorder* recorder, const World* world, int slot, int id) {
+    write_record(recorder, world->tick + 1, RECORD_JOIN, slot, 0, (uint64_t)id);
+}
+
+void recorder_leave(Recorder* recorder, const World* world, int slot) {
+    write_record(recorder, world->tick + 1, RECORD_LEAVE, slot, 0, 0);
+}
+
+void recorder_input(Recorder* recorder, const World* world, const Input* input) {
+    if (input->type == INPUT_MOVE) {
+        uint64_t value = (uint32_t)input->steps | ((uint64_t)input->seq << 32);
+        write_record(recorder, world->tick + 1, RECORD_MOVE, input->player_slot, input->direction, value);
+    } else {
+        write_record(recorder, world->tick + 1, RECORD_SHOOT, input->player_slot, input->direction, 0);
+    }
+}
+
+void recorder_checksum(Recorder* recorder, const World* world) {
+    write_record(recorder, world->tick, RECORD_CHECKSUM, 0, 0, world_checksum(world));
+}
+
+void recorder_close(Recorder* recorder) {
+    if (recorder->file != NULL) {
+        fclose(recorder->file);
+        recorder->file = NULL;
+    }
+}
+
+static uint8_t* read_file(const char* path, long* size) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror("Cannot open recording");
+        return NULL;
+    }
+    uint8_t* data = NULL;
+    if (fseek(file, 0, SEEK_END) == 0 && (*size = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0 &&
+        (data = malloc(*size > 0 ? *size : 1)) != NULL && fread(data, 1, *size, file) != (size_t)*size) {
+        free(data);
+        data = NULL;
+    }
+    if (data == NULL) {
+        perror("Cannot read recording");
+    }
+    fclose(file);
+    return data;
+}
+
+int replay_file(const char* path, const Map* map, ReplayResult* result) {
+    memset(result, 0, sizeof(*result));
+    long size;
+    uint8_t* data = read_file(path, &size);
+    if (data == NULL) {
+        return -1;
+    }
+
+    if (size < RECORDING_HEADER_SIZE || get_u32(data) != RECORDING_MAGIC || get_u16(data + 4) != RECORDING_VERSION) {
+        fprintf(stderr, "%s is not a recording this build can replay.\n", path);
+        free(data);
+        return -1;
+    }
+
+    WorldConfig config;
+    config.width = get_u16(data + 16);
+    config.height = get_u16(data + 18);
+    config.max_players = get_u16(data + 20);
+    config.max_ghosts = get_u16(data + 22);
+    config.bullets_per_player = get_u16(data + 24);
+    config.fire_cooldown = get_u16(data + 26);
+    config.map = map;
+    int ghost_interval = get_u16(data + 6);
+    uint32_t map_checksum = get_u32(data + 28);
+    if (map_checksum != (map != NULL ? map->checksum : 0)) {
+        if (map_checksum != 0) {
+            fprintf(stderr, "%s was recorded on the map with checksum %08x.\n", path, map_checksum);
+        } else {
+            fprintf(stderr, "%s was recorded on generated walls; replay it without a map.\n", path);
+        }
+        free(data);
+        return -1;
+    }
+    if (ghost_interval <= 0 || world_config_validate(&config) < 0) {
+        fprintf(stderr, "%s is not a recording this build can replay.\n", path);
+        free(data);
+        return -1;
+    }
+
+    World world;
+    if (world_create(&world, &config) < 0) {
+        perror("World allocation failed");
+        free(data);
+        return -1;
+    }
+    world_init(&world, get_u64(data + 8));
+
+    int status = 0;
+    long start = clock_ns();
+    for (long offset = RECORDING_HEADER_SIZE; offset + RECORDING_RECORD_SIZE <= size;
+         offset += RECORDING_RECORD_SIZE) {
+        const uint8_t* record = data + offset;
+        uint32_t tick = get_u32(record);
+        int type = record[4];
+        int slot = record[5];
+        uint64_t value = get_u64(record + 8);
+
+        if (type == RECORD_CHECKSUM) {
+            while ((int32_t)(tick - world.tick) > 0) {
+                world_step(&world, ghost_interval);
+            }
+            result->checksums++;
+            if (world_checksum(&world) != value && result->mismatches++ == 0) {
+                result->first_mismatch = tick;
+            }
+            continue;
+        }
+
+        while ((int32_t)(tick - world.tick) > 1) {
+            world_step(&world, ghost_interval);
+        }
+        if (tick != world.tick + 1 || slot >= config.max_players) {
+            fprintf(stderr, "Recording is corrupt at byte %ld.\n", offset);
+            status = -1;
+            break;
+        }
+
+        Input input = {slot, INPUT_MOVE, (int32_t)(uint32_t)value, (char)record[6], (uint16_t)(value >> 32)};
+        switch (type) {
+            case RECORD_JOIN:
+                world_add_player(&world, slot, (int)value);
+                break;
+            case RECORD_LEAVE:
+                world_remove_player(&world, slot);
+                break;
+            case RECORD_SHOOT:
+                input.type = INPUT_SHOOT;
+                input.steps = 0;
+                input.seq = 0;
+                // fall through
+            case RECORD_MOVE:
+                world_apply_input(&world, &input);
+                result->inputs++;
+                break;
+        }
+    }
+    result->seconds = (clock_ns() - start) / 1e9;
+    result->ticks = world.tick;
+
+    world_destroy(&world);
+    free(data);
+    if (status == 0 && result->mismatches > 0) {
+        status = 1;
+    }
+    return status;
+}
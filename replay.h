@@ -0,0 +1,114 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "world.h"
+#include <stdio.h>
+
+// Recording format (all integers little-endian):
+//   header : magic u32, version u16, ghost_interval u16, seed u64,
+//            width u16, height u16, max_players u16, max_ghosts u16,
+//            bullets_per_player u16, fire_cooldown u16, map u32
+//   map    : checksum of the map file played on, 0 for generated walls
+//   records: tick u32, type u8, slot u8, direction u8, reserved u8,
+//            value u64, in the order they were applied to the world
+// Joins, leaves and inputs carry the tick they precede; a checksum
+// carries the tick it was taken after.
+#define RECORDING_MAGIC 0x43455242  // "BREC"
+#define RECORDING_VERSION 2
+#define RECORDING_HEADER_SIZE 32
+#define RECORDING_RECORD_SIZE 16
+
+typedef enum {
+    RECORD_JOIN = 0,      // value: player id
+    RECORD_LEAVE = 1,
+    RECORD_MOVE = 2,      // value: steps u32, then seq u16
+    RECORD_SHOOT = 3,
+    RECORD_CHECKSUM = 4   // value: world_checksum()
+} RecordType;
+
+// Everything that changes one world, from world_init() on. Every call is
+// a no-op while file is NULL.
+typedef struct {
+    FILE* file;
+} Recorder;
+
+typedef struct {
+    uint32_t ticks;
+    unsigned long inputs;
+    unsigned long checksums;
+    unsigned long mismatches;
+    uint32_t first_mismatch;  // tick of the first mismatch, if any
+    double seconds;           // time spent simulating
+} ReplayResult;
+
+/**
+ * @brief Start a recording of a freshly initialized world.
+ *
+ * @param recorder The recorder to open.
+ * @param path The file to create.
+ * @param config The world's configuration, including its map if any.
+ * @param seed The seed given to world_init().
+ * @param ghost_interval Ticks between ghost steps.
+ * @return 0 on success, or -1 if the file could not be written.
+ */
+int recorder_open(Recorder* recorder, const char* path, const WorldConfig* config, uint64_t seed,
+                  int ghost_interval);
+
+/**
+ * @brief Record world_add_player(), called just after it.
+ *
+ * @param recorder The recorder.
+ * @param world The world.
+ * @param slot The player slot.
+ * @param id The player id.
+ */
+void recorder_join(Recorder* recorder, const World* world, int slot, int id);
+
+/**
+ * @brief Record world_remove_player(), called just after it.
+ *
+ * @param recorder The recorder.
+ * @param world The world.
+ * @param slot The player slot.
+ */
+void recorder_leave(Recorder* recorder, const World* world, int slot);
+
+/**
+ * @brief Record an input applied with world_apply_input().
+ *
+ * @param recorder The recorder.
+ * @param world The world, before the step the input precedes.
+ * @param input The input.
+ */
+void recorder_input(Recorder* recorder, const World* world, const Input* input);
+
+/**
+ * @brief Record the world's checksum after a world_step().
+ *
+ * @param recorder The recorder.
+ * @param world The world.
+ */
+void recorder_checksum(Recorder* recorder, const World* world);
+
+/**
+ * @brief Finish the recording and close its file.
+ *
+ * @param recorder The recorder.
+ */
+void recorder_close(Recorder* recorder);
+
+/**
+ * @brief Re-simulate a recording as fast as possible.
+ *
+ * The file is read into memory first so only the simulation is timed.
+ * Every recorded checksum is compared against the replayed world.
+ *
+ * @param path The recording.
+ * @param map The map it was recorded on, or NULL for generated walls.
+ * @param result Filled with tick, input and checksum counts and timing.
+ * @return 0 if every checksum matched, 1 if any differed, or -1 if the
+ *         recording could not be read.
+ */
+int replay_file(const char* path, const Map* map, ReplayResult* result);
+
+#endif // REPLAY_H
@@ -3,7 +3,32 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
+#include <time.h>
+
+static void put_u16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+}
+
+static void put_u32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static uint16_t get_u16(const uint8_t* p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_u32(const uint8_t* p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
 int init_server_socket(int port) {
     int server_fd;
@@ -36,7 +61,7 @@ int init_server_socket(int port) {
     }
 
     // Start listening
-    if (listen(server_fd, 2) < 0) {
+    if (listen(server_fd, SOMAXCONN) < 0) {
         perror("listen");
         close(server_fd);
         exit(EXIT_FAILURE);
@@ -45,6 +70,28 @@ int init_server_socket(int port) {
     return server_fd;
 }
 
+int init_loopback_socket(int port) {
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) {
+        perror("Socket creation error");
+        return -1;
+    }
+
+    int opt = 1;
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(sock, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(sock, SOMAXCONN) < 0) {
+        perror("Loopback socket setup failed");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
 int init_client_socket(const char* server_ip, int port) {
     int sock = 0;
     struct sockaddr_in serv_addr;
@@ -73,22 +120,896 @@ int init_client_socket(const char* server_ip, int port) {
     return sock;
 }
 
+int init_server_datagram_socket(int port) {
+    int server_fd;
+    struct sockaddr_in address;
+    int opt = 1;
+
+    if ((server_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0)) < 0) {
+        perror("socket failed");
+        exit(EXIT_FAILURE);
+    }
+
+    // Every I/O thread binds its own socket to the port.
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
+        perror("setsockopt");
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+
+    if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
+        perror("bind failed");
+        close(server_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    return server_fd;
+}
+
+int init_client_datagram_socket(const char* server_ip, int port) {
+    int sock = 0;
+    struct sockaddr_in serv_addr;
+
+    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+        perror("Socket creation error");
+        exit(EXIT_FAILURE);
+    }
+
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, server_ip, &serv_addr.sin_addr) <= 0) {
+        perror("Invalid address/Address not supported");
+        close(sock);
+        exit(EXIT_FAILURE);
+    }
+
+    // Connecting only fixes the peer, so plain send() and recv() work and
+    // datagrams from anyone else are filtered out.
+    if (connect(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+        perror("Connection Failed");
+        close(sock);
+        exit(EXIT_FAILURE);
+    }
+
+    return sock;
+}
+
+long clock_ms(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+int set_nonblocking(int socket) {
+    int flags = fcntl(socket, F_GETFL, 0);
+    if (flags < 0 || fcntl(socket, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        return -1;
+    }
+    return 0;
+}
+
+int send_frame(int socket, const void* data, int len) {
+    uint8_t header[FRAME_HEADER_SIZE];
+    put_u32(header, (uint32_t)len);
+
+    struct iovec iov[2] = {
+        {header, FRAME_HEADER_SIZE},
+        {(void*)data, (size_t)len},
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+
+    // Keep writing until the whole frame is out so frames never interleave
+    // with a partially written predecessor.
+    int remaining = FRAME_HEADER_SIZE + len;
+    while (remaining > 0) {
+        ssize_t bytes_sent = sendmsg(socket, &msg, MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // Non-blocking socket with a full send buffer: wait for room
+                // rather than leave half a frame on the stream.
+                struct pollfd pfd = {socket, POLLOUT, 0};
+                if (poll(&pfd, 1, SEND_TIMEOUT_MS) > 0) {
+                    continue;
+                }
+                fprintf(stderr, "Send timed out on socket %d\n", socket);
+                return -1;
+            }
+            perror("Send failed");
+            return -1;
+        }
+        remaining -= (int)bytes_sent;
+        while (msg.msg_iovlen > 0 && (size_t)bytes_sent >= msg.msg_iov->iov_len) {
+            bytes_sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + bytes_sent;
+            msg.msg_iov->iov_len -= bytes_sent;
+        }
+    }
+    return len;
+}
+
 int send_data(int socket, const char* data) {
-    int len = strlen(data);
-    int bytes_sent = send(socket, data, len, 0);
-    if (bytes_sent < 0) {
-        perror("Send failed: Socket operation on non-socket");
+    return send_frame(socket, data, strlen(data));
+}
+
+int frame_buffer_init(FrameBuffer* frames, int cap) {
+    frames->data = malloc(cap);
+    frames->cap = cap;
+    frames->len = 0;
+    frames->start = 0;
+    return frames->data != NULL ? 0 : -1;
+}
+
+void frame_buffer_free(FrameBuffer* frames) {
+    free(frames->data);
+    frames->data = NULL;
+}
+
+int frame_buffer_reserve(FrameBuffer* frames, int cap) {
+    if (cap <= frames->cap) {
+        return 0;
+    }
+    uint8_t* data = realloc(frames->data, cap);
+    if (data == NULL) {
         return -1;
     }
-    return bytes_sent;
+    frames->data = data;
+    frames->cap = cap;
+    return 0;
 }
 
-int receive_data(int socket, char* buffer, int buffer_size) {
-    memset(buffer, 0, buffer_size);
-    int bytes_received = recv(socket, buffer, buffer_size - 1, 0);
+int receive_frames(int socket, FrameBuffer* frames) {
+    // Slide the unconsumed tail (at most one partial frame) to the front.
+    if (frames->start > 0) {
+        frames->len -= frames->start;
+        memmove(frames->data, frames->data + frames->start, frames->len);
+        frames->start = 0;
+    }
+
+    int bytes_received;
+    do {
+        bytes_received = recv(socket, frames->data + frames->len, frames->cap - frames->len, 0);
+    } while (bytes_received < 0 && errno == EINTR);
+
     if (bytes_received < 0) {
-        perror("Receive failed");
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            perror("Receive failed");
+        }
         return -1;
     }
+    frames->len += bytes_received;
     return bytes_received;
-}
\ No newline at end of file
+}
+
+int next_frame(FrameBuffer* frames, const uint8_t** payload, int* len) {
+    int available = frames->len - frames->start;
+    if (available < FRAME_HEADER_SIZE) {
+        return 0;
+    }
+
+    uint32_t size = get_u32(frames->data + frames->start);
+    if (size > (uint32_t)(frames->cap - FRAME_HEADER_SIZE)) {
+        return -1;
+    }
+    if ((uint32_t)available < FRAME_HEADER_SIZE + size) {
+        return 0;
+    }
+
+    *payload = frames->data + frames->start + FRAME_HEADER_SIZE;
+    *len = (int)size;
+    frames->start += FRAME_HEADER_SIZE + size;
+    return 1;
+}
+
+OutBuffer* out_buffer_alloc(int payload_cap, int droppable) {
+    OutBuffer* buffer = malloc(sizeof(OutBuffer) + FRAME_HEADER_SIZE + payload_cap);
+    if (buffer == NULL) {
+        return NULL;
+    }
+    buffer->refs = 1;
+    buffer->droppable = droppable;
+    buffer->len = FRAME_HEADER_SIZE;
+    return buffer;
+}
+
+void out_buffer_seal(OutBuffer* buffer, int payload_len) {
+    put_u32(buffer->data, (uint32_t)payload_len);
+    buffer->len = FRAME_HEADER_SIZE + payload_len;
+}
+
+OutBuffer* out_buffer_create(const void* payload, int len, int droppable) {
+    OutBuffer* buffer = out_buffer_alloc(len, droppable);
+    if (buffer != NULL) {
+        memcpy(buffer->data + FRAME_HEADER_SIZE, payload, len);
+        out_buffer_seal(buffer, len);
+    }
+    return buffer;
+}
+
+void out_buffer_release(OutBuffer* buffer) {
+    if (__atomic_sub_fetch(&buffer->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        free(buffer);
+    }
+}
+
+void out_queue_init(OutQueue* queue) {
+    queue->head = 0;
+    queue->count = 0;
+    queue->offset = 0;
+    queue->bytes = 0;
+}
+
+void out_queue_clear(OutQueue* queue) {
+    for (int i = 0; i < queue->count; i++) {
+        out_buffer_release(queue->items[(queue->head + i) % OUT_QUEUE_DEPTH]);
+    }
+    out_queue_init(queue);
+}
+
+int out_queue_push(OutQueue* queue, OutBuffer* buffer) {
+    if (queue->count == OUT_QUEUE_DEPTH) {
+        return -1;
+    }
+    __atomic_add_fetch(&buffer->refs, 1, __ATOMIC_RELAXED);
+    queue->items[(queue->head + queue->count) % OUT_QUEUE_DEPTH] = buffer;
+    queue->count++;
+    queue->bytes += buffer->len;
+    return 0;
+}
+
+int out_queue_collapse(OutQueue* queue) {
+    int kept = 0, dropped = 0;
+    for (int i = 0; i < queue->count; i++) {
+        OutBuffer* buffer = queue->items[(queue->head + i) % OUT_QUEUE_DEPTH];
+        // A partially written head must finish or the stream loses framing.
+        if (buffer->droppable && !(i == 0 && queue->offset > 0)) {
+            queue->bytes -= buffer->len;
+            out_buffer_release(buffer);
+            dropped++;
+        } else {
+            queue->items[(queue->head + kept) % OUT_QUEUE_DEPTH] = buffer;
+            kept++;
+        }
+    }
+    queue->count = kept;
+    return dropped;
+}
+
+int out_queue_flush(int socket, OutQueue* queue) {
+    while (queue->count > 0) {
+        struct iovec iov[OUT_QUEUE_DEPTH];
+        for (int i = 0; i < queue->count; i++) {
+            OutBuffer* buffer = queue->items[(queue->head + i) % OUT_QUEUE_DEPTH];
+            int skip = i == 0 ? queue->offset : 0;
+            iov[i].iov_base = buffer->data + skip;
+            iov[i].iov_len = buffer->len - skip;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = queue->count;
+
+        ssize_t bytes_sent = sendmsg(socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+
+        queue->bytes -= (int)bytes_sent;
+        while (queue->count > 0) {
+            OutBuffer* buffer = queue->items[queue->head];
+            int left = buffer->len - queue->offset;
+            if (bytes_sent < left) {
+                queue->offset += (int)bytes_sent;
+                break;
+            }
+            bytes_sent -= left;
+            queue->offset = 0;
+            queue->head = (queue->head + 1) % OUT_QUEUE_DEPTH;
+            queue->count--;
+            out_buffer_release(buffer);
+        }
+    }
+    return 1;
+}
+
+OutBuffer* out_queue_pop(OutQueue* queue) {
+    if (queue->count == 0) {
+        return NULL;
+    }
+    OutBuffer* buffer = queue->items[queue->head];
+    queue->bytes -= buffer->len - queue->offset;
+    queue->offset = 0;
+    queue->head = (queue->head + 1) % OUT_QUEUE_DEPTH;
+    queue->count--;
+    return buffer;
+}
+
+// Sequence numbers wrap, so compare them by their signed distance.
+static int seq_after(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) > 0;
+}
+
+// A lost datagram is expected in UDP mode; only report surprising errors.
+static void send_datagram(int socket, const struct sockaddr_in* peer, uint8_t type, uint32_t seq,
+                          const void* payload, int len) {
+    uint8_t header[DATAGRAM_HEADER_SIZE];
+    header[0] = DATAGRAM_MAGIC;
+    header[1] = type;
+    put_u16(header + 2, 0);
+    put_u32(header + 4, seq);
+
+    struct iovec iov[2] = {
+        {header, DATAGRAM_HEADER_SIZE},
+        {(void*)payload, (size_t)len},
+    };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void*)peer;
+    msg.msg_namelen = peer != NULL ? sizeof(*peer) : 0;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = len > 0 ? 2 : 1;
+
+    ssize_t bytes_sent;
+    do {
+        bytes_sent = sendmsg(socket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } while (bytes_sent < 0 && errno == EINTR);
+
+    if (bytes_sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS && errno != ECONNREFUSED) {
+        perror("Send failed");
+    }
+}
+
+void channel_init(DatagramChannel* channel) {
+    memset(channel, 0, sizeof(*channel));
+    channel->reliable_next = 1;
+}
+
+void channel_clear(DatagramChannel* channel) {
+    for (uint32_t seq = channel->reliable_acked + 1; seq != channel->reliable_next; seq++) {
+        out_buffer_release(channel->pending[seq % RELIABLE_WINDOW]);
+    }
+    channel_init(channel);
+}
+
+int channel_send(int socket, const struct sockaddr_in* peer, DatagramChannel* channel, const void* payload,
+                 int len, int reliable) {
+    if (!reliable) {
+        send_datagram(socket, peer, DATAGRAM_UNRELIABLE, ++channel->unreliable_sent, payload, len);
+        return 0;
+    }
+
+    if (channel->reliable_next - channel->reliable_acked - 1 >= RELIABLE_WINDOW) {
+        return -1;
+    }
+    OutBuffer* buffer = out_buffer_create(payload, len, 0);
+    if (buffer == NULL) {
+        perror("Out buffer allocation failed");
+        return -1;
+    }
+    if (channel->reliable_next - channel->reliable_acked == 1) {
+        channel->resend_at_ms = clock_ms() + RESEND_INTERVAL_MS;
+    }
+    uint32_t seq = channel->reliable_next++;
+    channel->pending[seq % RELIABLE_WINDOW] = buffer;
+    send_datagram(socket, peer, DATAGRAM_RELIABLE, seq, payload, len);
+    return 0;
+}
+
+int channel_resend(int socket, const struct sockaddr_in* peer, DatagramChannel* channel) {
+    if (channel->reliable_next - channel->reliable_acked == 1) {
+        return 0;
+    }
+    long now = clock_ms();
+    if (now < channel->resend_at_ms) {
+        return 0;
+    }
+    if (++channel->resends > RESEND_LIMIT) {
+        return -1;
+    }
+
+    for (uint32_t seq = channel->reliable_acked + 1; seq != channel->reliable_next; seq++) {
+        OutBuffer* buffer = channel->pending[seq % RELIABLE_WINDOW];
+        send_datagram(socket, peer, DATAGRAM_RELIABLE, seq, buffer->data + FRAME_HEADER_SIZE,
+                      buffer->len - FRAME_HEADER_SIZE);
+    }
+    channel->resend_at_ms = now + RESEND_INTERVAL_MS;
+    return 0;
+}
+
+int channel_receive(int socket, const struct sockaddr_in* peer, DatagramChannel* channel, const uint8_t* datagram,
+                    int len, const uint8_t** payload, int* payload_len) {
+    if (len < DATAGRAM_HEADER_SIZE || datagram[0] != DATAGRAM_MAGIC) {
+        return 0;
+    }
+    uint32_t seq = get_u32(datagram + 4);
+    *payload = datagram + DATAGRAM_HEADER_SIZE;
+    *payload_len = len - DATAGRAM_HEADER_SIZE;
+
+    switch (datagram[1]) {
+        case DATAGRAM_UNRELIABLE:
+            // Anything older than what we already have is stale.
+            if (!seq_after(seq, channel->unreliable_received)) {
+                return 0;
+            }
+            channel->unreliable_received = seq;
+            return 1;
+
+        case DATAGRAM_RELIABLE: {
+            // Only the next message in order is taken; anything after a gap
+            // comes round again with the resends.
+            int deliver = seq == channel->reliable_received + 1;
+            if (deliver) {
+                channel->reliable_received = seq;
+            }
+            send_datagram(socket, peer, DATAGRAM_ACK, channel->reliable_received, NULL, 0);
+            return deliver;
+        }
+
+        case DATAGRAM_ACK:
+            if (seq_after(seq, channel->reliable_acked) && seq_after(channel->reliable_next, seq)) {
+                while (channel->reliable_acked != seq) {
+                    channel->reliable_acked++;
+                    out_buffer_release(channel->pending[channel->reliable_acked % RELIABLE_WINDOW]);
+                }
+                channel->resends = 0;
+                channel->resend_at_ms = clock_ms() + RESEND_INTERVAL_MS;
+            }
+            return 0;
+
+        case DATAGRAM_DISCONNECT:
+            return -1;
+    }
+    return 0;
+}
+
+void channel_disconnect(int socket, const struct sockaddr_in* peer) {
+    send_datagram(socket, peer, DATAGRAM_DISCONNECT, 0, NULL, 0);
+}
+
+int datagram_is_connect(const uint8_t* datagram, int len) {
+    int connect_len = (int)strlen(DATAGRAM_CONNECT);
+    return len == DATAGRAM_HEADER_SIZE + connect_len && datagram[0] == DATAGRAM_MAGIC &&
+           datagram[1] == DATAGRAM_RELIABLE && get_u32(datagram + 4) == 1 &&
+           memcmp(datagram + DATAGRAM_HEADER_SIZE, DATAGRAM_CONNECT, connect_len) == 0;
+}
+
+int receive_datagram(int socket, uint8_t* buf, struct sockaddr_in* from) {
+    socklen_t from_len = sizeof(*from);
+    ssize_t bytes_received;
+    do {
+        bytes_received = recvfrom(socket, buf, DATAGRAM_MAX_SIZE, 0, (struct sockaddr*)from,
+                                  from != NULL ? &from_len : NULL);
+    } while (bytes_received < 0 && errno == EINTR);
+
+    if (bytes_received < 0) {
+        // A connected socket reports an unreachable peer on the next call.
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNREFUSED) {
+            perror("Receive failed");
+        }
+        return -1;
+    }
+    return (int)bytes_received;
+}
+
+int snapshot_max_size(int max_entities) {
+    return SNAPSHOT_HEADER_SIZE + max_entities * (SNAPSHOT_RECORD_SIZE + SNAPSHOT_REMOVED_SIZE);
+}
+
+static int entity_key(const EntityRecord* record) {
+    return (record->kind << 16) | record->id;
+}
+
+static int entity_equal(const EntityRecord* a, const EntityRecord* b) {
+    return a->dir == b->dir && a->x == b->x && a->y == b->y && a->data == b->data;
+}
+
+void snapshot_begin(SnapshotWriter* writer, uint8_t* buf, int cap, uint32_t tick, uint32_t base_tick, int width, int height) {
+    writer->buf = buf;
+    writer->cap = cap;
+    writer->len = SNAPSHOT_HEADER_SIZE;
+    writer->removed = 0;
+    writer->overflow = cap < SNAPSHOT_HEADER_SIZE;
+    for (int k = 0; k < ENTITY_KIND_COUNT; k++) {
+        writer->counts[k] = 0;
+    }
+    if (writer->overflow) {
+        return;
+    }
+
+    buf[0] = SNAPSHOT_MAGIC;
+    buf[1] = SNAPSHOT_VERSION;
+    buf[2] = base_tick != 0 ? SNAPSHOT_FLAG_DELTA : 0;
+    buf[3] = 0;
+    put_u32(buf + 4, tick);
+    put_u32(buf + 8, base_tick);
+    put_u16(buf + 12, (uint16_t)width);
+    put_u16(buf + 14, (uint16_t)height);
+}
+
+void snapshot_add(SnapshotWriter* writer, const EntityRecord* record) {
+    if (writer->overflow || writer->len + SNAPSHOT_RECORD_SIZE > writer->cap) {
+        writer->overflow = 1;
+        return;
+    }
+
+    uint8_t* p = writer->buf + writer->len;
+    p[0] = record->kind;
+    p[1] = record->dir;
+    put_u16(p + 2, record->id);
+    put_u16(p + 4, record->x);
+    put_u16(p + 6, record->y);
+    put_u16(p + 8, record->data);
+    writer->counts[record->kind]++;
+    writer->len += SNAPSHOT_RECORD_SIZE;
+}
+
+static void snapshot_add_removed(SnapshotWriter* writer, const EntityRecord* record) {
+    if (writer->overflow || writer->len + SNAPSHOT_REMOVED_SIZE > writer->cap) {
+        writer->overflow = 1;
+        return;
+    }
+
+    uint8_t* p = writer->buf + writer->len;
+    p[0] = record->kind;
+    p[1] = 0;
+    put_u16(p + 2, record->id);
+    writer->removed++;
+    writer->len += SNAPSHOT_REMOVED_SIZE;
+}
+
+void snapshot_write_delta(SnapshotWriter* writer, const EntityRecord* base, int base_count,
+                          const EntityRecord* current, int current_count) {
+    int b = 0;
+    for (int c = 0; c < current_count; c++) {
+        int key = entity_key(&current[c]);
+        while (b < base_count && entity_key(&base[b]) < key) {
+            b++;
+        }
+        if (b < base_count && entity_key(&base[b]) == key && entity_equal(&base[b], &current[c])) {
+            continue;
+        }
+        snapshot_add(writer, &current[c]);
+    }
+
+    int c = 0;
+    for (b = 0; b < base_count; b++) {
+        int key = entity_key(&base[b]);
+        while (c < current_count && entity_key(&current[c]) < key) {
+            c++;
+        }
+        if (c == current_count || entity_key(&current[c]) != key) {
+            snapshot_add_removed(writer, &base[b]);
+        }
+    }
+}
+
+int snapshot_finish(SnapshotWriter* writer) {
+    if (writer->overflow) {
+        return -1;
+    }
+    for (int k = 0; k < ENTITY_KIND_COUNT; k++) {
+        put_u16(writer->buf + 16 + 2 * k, (uint16_t)writer->counts[k]);
+    }
+    put_u16(writer->buf + 22, (uint16_t)writer->removed);
+    return writer->len;
+}
+
+int snapshot_decode(const uint8_t* buf, int len, SnapshotView* view) {
+    if (len < SNAPSHOT_HEADER_SIZE || buf[0] != SNAPSHOT_MAGIC || buf[1] != SNAPSHOT_VERSION) {
+        return -1;
+    }
+
+    view->version = buf[1];
+    view->flags = buf[2];
+    view->tick = get_u32(buf + 4);
+    view->base_tick = get_u32(buf + 8);
+    view->width = get_u16(buf + 12);
+    view->height = get_u16(buf + 14);
+    view->removed = get_u16(buf + 22);
+
+    int total = 0;
+    for (int k = 0; k < ENTITY_KIND_COUNT; k++) {
+        view->counts[k] = get_u16(buf + 16 + 2 * k);
+        total += view->counts[k];
+    }
+
+    int offset = SNAPSHOT_HEADER_SIZE;
+    view->records = buf + offset;
+    offset += total * SNAPSHOT_RECORD_SIZE;
+    view->removals = buf + offset;
+    offset += view->removed * SNAPSHOT_REMOVED_SIZE;
+
+    return offset <= len ? 0 : -1;
+}
+
+void snapshot_record(const SnapshotView* view, int index, EntityRecord* record) {
+    const uint8_t* p = view->records + index * SNAPSHOT_RECORD_SIZE;
+    record->kind = p[0];
+    record->dir = p[1];
+    record->id = get_u16(p + 2);
+    record->x = get_u16(p + 4);
+    record->y = get_u16(p + 6);
+    record->data = get_u16(p + 8);
+}
+
+int snapshot_entities(const SnapshotView* view, const EntityRecord* base, int base_count, EntityRecord* out, int cap) {
+    int total = view->counts[ENTITY_PLAYER] + view->counts[ENTITY_BULLET] + view->counts[ENTITY_GHOST];
+    if (!(view->flags & SNAPSHOT_FLAG_DELTA)) {
+        base_count = 0;
+    }
+
+    // Three-way merge of the baseline, the changed records and the removals,
+    // all of which are sorted by (kind, id).
+    int count = 0, b = 0, c = 0, r = 0;
+    EntityRecord changed, removed;
+    if (c < total) {
+        snapshot_record(view, c, &changed);
+    }
+    while (b < base_count || c < total) {
+        int base_key = b < base_count ? entity_key(&base[b]) : 0x7fffffff;
+        int changed_key = c < total ? entity_key(&changed) : 0x7fffffff;
+
+        if (count == cap) {
+            return -1;
+        }
+        if (changed_key <= base_key) {
+            out[count++] = changed;
+            if (changed_key == base_key) {
+                b++;
+            }
+            if (++c < total) {
+                snapshot_record(view, c, &changed);
+            }
+            continue;
+        }
+
+        int dropped = 0;
+        while (r < view->removed) {
+            const uint8_t* p = view->removals + r * SNAPSHOT_REMOVED_SIZE;
+            removed.kind = p[0];
+            removed.id = get_u16(p + 2);
+            int removed_key = entity_key(&removed);
+            if (removed_key > base_key) {
+                break;
+            }
+            r++;
+            if (removed_key == base_key) {
+                dropped = 1;
+                break;
+            }
+        }
+        if (!dropped) {
+            out[count++] = base[b];
+        }
+        b++;
+    }
+    return count;
+}
+
+int map_bitmap_size(int width, int height) {
+    return (int)(((long)width * height + 7) / 8);
+}
+
+int map_wall(const uint8_t* walls, int width, int x, int y) {
+    long i = (long)y * width + x;
+    return (walls[i >> 3] >> (i & 7)) & 1;
+}
+
+int map_tile_encode(uint8_t* buf, const uint8_t* cells, int width, int height, int tile_x, int tile_y) {
+    buf[0] = MAP_TILE_MAGIC;
+    buf[1] = 0;
+    put_u16(buf + 2, (uint16_t)tile_x);
+    put_u16(buf + 4, (uint16_t)tile_y);
+
+    uint8_t* bits = buf + MAP_TILE_HEADER_SIZE;
+    memset(bits, 0, MAP_TILE_SIZE - MAP_TILE_HEADER_SIZE);
+    int first_x = tile_x * MAP_TILE_CELLS;
+    int first_y = tile_y * MAP_TILE_CELLS;
+    for (int y = 0; y < MAP_TILE_CELLS && first_y + y < height; y++) {
+        const uint8_t* row = cells + (long)(first_y + y) * width + first_x;
+        for (int x = 0; x < MAP_TILE_CELLS && first_x + x < width; x++) {
+            if (row[x]) {
+                int i = y * MAP_TILE_CELLS + x;
+                bits[i >> 3] |= (uint8_t)(1 << (i & 7));
+            }
+        }
+    }
+    return MAP_TILE_SIZE;
+}
+
+int map_tile_decode(const uint8_t* buf, int len, uint8_t* walls, int width, int height, int* tile_x, int* tile_y) {
+    if (len < MAP_TILE_SIZE || buf[0] != MAP_TILE_MAGIC) {
+        return -1;
+    }
+    int first_x = get_u16(buf + 2) * MAP_TILE_CELLS;
+    int first_y = get_u16(buf + 4) * MAP_TILE_CELLS;
+    if (first_x >= width || first_y >= height) {
+        return -1;
+    }
+    *tile_x = first_x / MAP_TILE_CELLS;
+    *tile_y = first_y / MAP_TILE_CELLS;
+
+    const uint8_t* bits = buf + MAP_TILE_HEADER_SIZE;
+    for (int y = 0; y < MAP_TILE_CELLS && first_y + y < height; y++) {
+        for (int x = 0; x < MAP_TILE_CELLS && first_x + x < width; x++) {
+            int i = y * MAP_TILE_CELLS + x;
+            long cell = (long)(first_y + y) * width + first_x + x;
+            uint8_t mask = (uint8_t)(1 << (cell & 7));
+            if ((bits[i >> 3] >> (i & 7)) & 1) {
+                walls[cell >> 3] |= mask;
+            } else {
+                walls[cell >> 3] &= (uint8_t)~mask;
+            }
+        }
+    }
+    return 0;
+}
+
+StoredSnapshot* snapshot_store(StoredSnapshot* history, int max_entities, const SnapshotView* view) {
+    const StoredSnapshot* baseline = NULL;
+    if (view->flags & SNAPSHOT_FLAG_DELTA) {
+        baseline = &history[view->base_tick % SNAPSHOT_HISTORY];
+        if (baseline->tick != view->base_tick || view->tick <= view->base_tick ||
+            view->tick - view->base_tick >= SNAPSHOT_HISTORY) {
+            return NULL;
+        }
+    }
+
+    StoredSnapshot* stored = &history[view->tick % SNAPSHOT_HISTORY];
+    int count = snapshot_entities(view, baseline != NULL ? baseline->entities : NULL,
+                                  baseline != NULL ? baseline->count : 0, stored->entities, max_entities);
+    if (count < 0) {
+        stored->tick = 0;
+        return NULL;
+    }
+    stored->tick = view->tick;
+    stored->count = count;
+    return stored;
+}
+
+// Field letters: 'i' a decimal integer, 'c' one character.
+typedef struct {
+    const char* keyword;
+    int keyword_len;
+    const char* fields;
+    int required;  // leading fields that must be present
+} MessageFormat;
+
+static const MessageFormat message_formats[MESSAGE_TYPE_COUNT] = {
+    [MESSAGE_ACK] = {"ACK", 3, "i", 1},
+    [MESSAGE_MOVE] = {"ACTION:MOVE", 11, "ici", 2},
+    [MESSAGE_SHOOT] = {"ACTION:SHOOT", 12, "c", 1},
+    [MESSAGE_ASSIGN_ID] = {"ASSIGN_ID", 9, "iiiiii", 6},
+    [MESSAGE_GAME_OVER] = {"GAME_OVER", 9, "i", 0},
+};
+
+// Keywords are told apart by at most two bytes, so only one table entry
+// is ever compared in full.
+static int message_candidate(const uint8_t* text, int len) {
+    if (len < 3) {
+        return -1;
+    }
+    switch (text[0]) {
+        case 'A':
+            if (text[1] == 'S') {
+                return MESSAGE_ASSIGN_ID;
+            }
+            if (text[2] == 'K') {
+                return MESSAGE_ACK;
+            }
+            return len > 7 && text[7] == 'M' ? MESSAGE_MOVE : MESSAGE_SHOOT;
+        case 'G':
+            return MESSAGE_GAME_OVER;
+        default:
+            return -1;
+    }
+}
+
+// Returns the bytes consumed, or 0 if text does not start with a number
+// that fits in an int32_t.
+static int parse_integer(const uint8_t* text, int len, int64_t* value) {
+    int i = 0;
+    int negative = len > 0 && text[0] == '-';
+    if (negative) {
+        i++;
+    }
+    int start = i;
+    int64_t limit = negative ? (int64_t)INT32_MAX + 1 : INT32_MAX;
+    int64_t result = 0;
+    while (i < len && text[i] >= '0' && text[i] <= '9') {
+        result = result * 10 + (text[i++] - '0');
+        if (result > limit) {
+            return 0;
+        }
+    }
+    if (i == start) {
+        return 0;
+    }
+    *value = negative ? -result : result;
+    return i;
+}
+
+int message_parse(const uint8_t* text, int len, Message* message) {
+    int type = message_candidate(text, len);
+    if (type < 0) {
+        return -1;
+    }
+    const MessageFormat* format = &message_formats[type];
+    if (len < format->keyword_len || memcmp(text, format->keyword, format->keyword_len) != 0) {
+        return -1;
+    }
+    message->type = (MessageType)type;
+
+    int pos = format->keyword_len;
+    int n = 0;
+    for (; format->fields[n] != '\0'; n++) {
+        if (pos == len) {
+            break;
+        }
+        if (text[pos] != ':') {
+            return -1;
+        }
+        pos++;
+        if (format->fields[n] == 'c') {
+            if (pos == len || text[pos] == ':') {
+                return -1;
+            }
+            message->fields[n] = text[pos++];
+        } else {
+            int used = parse_integer(text + pos, len - pos, &message->fields[n]);
+            if (used == 0) {
+                return -1;
+            }
+            pos += used;
+        }
+        if (pos < len && text[pos] != ':') {
+            return -1;
+        }
+    }
+    if (n < format->required) {
+        return -1;
+    }
+    message->field_count = n;
+    for (int i = n; i < MESSAGE_MAX_FIELDS; i++) {
+        message->fields[i] = 0;
+    }
+    return 0;
+}
+
+int handshake_parse(const Message* message, Handshake* handshake) {
+    static const int64_t minimums[6] = {INT32_MIN, 1, 1, 1, 0, 0};
+    if (message->type != MESSAGE_ASSIGN_ID) {
+        return -1;
+    }
+    for (int i = 0; i < 6; i++) {
+        if (message->fields[i] < minimums[i] || message->fields[i] > INT32_MAX) {
+            return -1;
+        }
+    }
+    handshake->id = (int)message->fields[0];
+    handshake->width = (int)message->fields[1];
+    handshake->height = (int)message->fields[2];
+    handshake->max_players = (int)message->fields[3];
+    handshake->max_ghosts = (int)message->fields[4];
+    handshake->max_bullets = (int)message->fields[5];
+    return 0;
+}
@@ -2,10 +2,189 @@
 #define SOCK_H
 
 #include <netinet/in.h>
+#include <stdint.h>
 
 #define BUFFER_SIZE 2048
 #define DEFAULT_PORT 8888
 
+// Every message on the stream is a u32 little-endian payload length
+// followed by the payload.
+#define FRAME_HEADER_SIZE 4
+
+// How long send_frame() waits for a non-blocking socket to drain.
+#define SEND_TIMEOUT_MS 1000
+
+// Frames waiting to be written to one connection.
+#define OUT_QUEUE_DEPTH 64
+
+// Binary snapshot wire format (all integers little-endian):
+//   header  : magic u8, version u8, flags u8, reserved u8, tick u32,
+//             base_tick u32, width u16, height u16, players u16,
+//             bullets u16, ghosts u16, removed u16
+//   records : players, then bullets, then ghosts, SNAPSHOT_RECORD_SIZE each
+//   removed : kind u8, reserved u8, id u16 per entity that left since
+//             base_tick, present only when SNAPSHOT_FLAG_DELTA is set
+// A delta snapshot carries only the records that changed or appeared
+// since base_tick, a tick the receiver has acknowledged. Record lists are
+// always sorted by (kind, id) so deltas are built and applied by merging.
+#define SNAPSHOT_MAGIC 0xB0
+#define SNAPSHOT_VERSION 3
+#define SNAPSHOT_HEADER_SIZE 24
+#define SNAPSHOT_RECORD_SIZE 10
+#define SNAPSHOT_REMOVED_SIZE 4
+#define SNAPSHOT_FLAG_DELTA 0x02
+
+// Map tile wire format: magic u8, reserved u8, tile_x u16, tile_y u16,
+// then MAP_TILE_CELLS * MAP_TILE_CELLS bits, row-major, 1 for a wall.
+// Cells past the edge of the map are 0. Walls never change while a world
+// lives, so each connection is sent every tile once, reliably, the ones
+// around its player first; snapshots carry only entities.
+#define MAP_TILE_MAGIC 0xB2
+#define MAP_TILE_CELLS 32
+#define MAP_TILE_HEADER_SIZE 6
+#define MAP_TILE_SIZE (MAP_TILE_HEADER_SIZE + MAP_TILE_CELLS * MAP_TILE_CELLS / 8)
+
+// Number of past snapshots either side keeps as delta baselines.
+#define SNAPSHOT_HISTORY 32
+
+// Datagram wire format (UDP mode): magic u8, type u8, reserved u16,
+// seq u32, then the same payload a frame would carry. Unreliable
+// datagrams are numbered on their own and anything older than the newest
+// one received is dropped. Reliable ones are delivered in order exactly
+// once; the receiver acks with the highest seq it has delivered and the
+// sender resends everything unacknowledged every RESEND_INTERVAL_MS.
+#define DATAGRAM_MAGIC 0xB1
+#define DATAGRAM_HEADER_SIZE 8
+#define DATAGRAM_MAX_SIZE 65507
+#define DATAGRAM_MAX_PAYLOAD (DATAGRAM_MAX_SIZE - DATAGRAM_HEADER_SIZE)
+#define RELIABLE_WINDOW 64
+#define RESEND_INTERVAL_MS 100
+// A peer that acknowledges nothing for this many resends is gone.
+#define RESEND_LIMIT 50
+// First reliable message a client sends; it opens the connection.
+#define DATAGRAM_CONNECT "CONNECT"
+
+typedef enum {
+    DATAGRAM_UNRELIABLE = 0,
+    DATAGRAM_RELIABLE = 1,
+    DATAGRAM_ACK = 2,
+    DATAGRAM_DISCONNECT = 3
+} DatagramType;
+
+typedef enum {
+    ENTITY_PLAYER = 0,
+    ENTITY_BULLET = 1,
+    ENTITY_GHOST = 2,
+    ENTITY_KIND_COUNT
+} EntityKind;
+
+typedef struct {
+    uint8_t kind;
+    uint8_t dir;    // bullets: 'U', 'D', 'L' or 'R'
+    uint16_t id;
+    uint16_t x;
+    uint16_t y;
+    uint16_t data;  // bullets: id of the owning player; players: last MOVE seq applied
+} EntityRecord;
+
+// One entry of a snapshot history ring, indexed by tick % SNAPSHOT_HISTORY.
+typedef struct {
+    uint32_t tick;
+    int count;
+    EntityRecord* entities;  // max_entities records
+} StoredSnapshot;
+
+// Text messages are a keyword and then ':'-separated fields, e.g.
+// "ACTION:MOVE:1:U:42". A field is either a decimal int32_t or a single
+// character. Optional trailing fields may be left out and read as 0, and
+// anything after the last field a message defines is ignored.
+#define MESSAGE_MAX_FIELDS 6
+// A MOVE covers at most this many cells; longer ones are cut short.
+#define MAX_MOVE_STEPS 9
+
+typedef enum {
+    MESSAGE_ACK,        // tick
+    MESSAGE_MOVE,       // steps (1 to MAX_MOVE_STEPS), direction[, seq]
+    MESSAGE_SHOOT,      // direction
+    MESSAGE_ASSIGN_ID,  // id, width, height, max_players, max_ghosts, max_bullets
+    MESSAGE_GAME_OVER,  // [seconds survived]
+    MESSAGE_TYPE_COUNT
+} MessageType;
+
+typedef struct {
+    MessageType type;
+    int field_count;                     // fields present
+    int64_t fields[MESSAGE_MAX_FIELDS];  // character fields hold the character
+} Message;
+
+// Limits the server announces in ASSIGN_ID when a client joins.
+typedef struct {
+    int id;
+    int width;
+    int height;
+    int max_players;
+    int max_ghosts;
+    int max_bullets;
+} Handshake;
+
+typedef struct {
+    uint8_t* data;
+    int cap;
+    int len;    // bytes buffered
+    int start;  // bytes already handed out as frames
+} FrameBuffer;
+
+// A complete frame (header included) shared by every queue it is on.
+typedef struct {
+    int refs;
+    int droppable;  // superseded by the next snapshot, may be skipped
+    int len;
+    uint8_t data[];
+} OutBuffer;
+
+typedef struct {
+    OutBuffer* items[OUT_QUEUE_DEPTH];
+    int head;
+    int count;
+    int offset;  // bytes of the head item already written
+    int bytes;   // bytes still to write
+} OutQueue;
+
+// Sequencing state for one UDP peer. Reliable messages in flight are kept
+// by seq % RELIABLE_WINDOW until acknowledged.
+typedef struct {
+    uint32_t unreliable_sent;      // seq of the last unreliable datagram sent
+    uint32_t unreliable_received;  // newest unreliable seq accepted
+    uint32_t reliable_next;        // seq for the next reliable message
+    uint32_t reliable_acked;       // the peer has every reliable seq up to this
+    uint32_t reliable_received;    // every reliable seq up to this was delivered
+    OutBuffer* pending[RELIABLE_WINDOW];
+    long resend_at_ms;
+    int resends;  // resend rounds since the peer last acknowledged anything
+} DatagramChannel;
+
+typedef struct {
+    uint8_t* buf;
+    int cap;
+    int len;
+    int counts[ENTITY_KIND_COUNT];
+    int removed;
+    int overflow;
+} SnapshotWriter;
+
+typedef struct {
+    uint8_t version;
+    uint8_t flags;
+    uint32_t tick;
+    uint32_t base_tick;
+    int width;
+    int height;
+    int counts[ENTITY_KIND_COUNT];
+    int removed;
+    const uint8_t* records;
+    const uint8_t* removals;
+} SnapshotView;
+
 /**
  * @brief Initialize a server socket.
  *
@@ -14,6 +193,14 @@
  */
 int init_server_socket(int port);
 
+/**
+ * @brief Initialize a listening socket reachable only from this machine.
+ *
+ * @param port The port number to bind on 127.0.0.1.
+ * @return The socket file descriptor, or -1 on failure.
+ */
+int init_loopback_socket(int port);
+
 /**
  * @brief Initialize a client socket and connect to the server.
  *
@@ -24,22 +211,450 @@ int init_server_socket(int port);
 int init_client_socket(const char* server_ip, int port);
 
 /**
- * @brief Send data over a socket.
+ * @brief Initialize a UDP server socket.
+ *
+ * Several sockets may bind the same port; the kernel keeps each peer on one.
+ *
+ * @param port The port number to bind the server.
+ * @return The non-blocking server socket file descriptor.
+ */
+int init_server_datagram_socket(int port);
+
+/**
+ * @brief Initialize a UDP client socket connected to the server.
+ *
+ * @param server_ip The IP address of the server.
+ * @param port The port number to connect to.
+ * @return The client socket file descriptor.
+ */
+int init_client_datagram_socket(const char* server_ip, int port);
+
+/**
+ * @brief Read the monotonic clock.
+ *
+ * @return Milliseconds since an arbitrary fixed point.
+ */
+long clock_ms(void);
+
+/**
+ * @brief Put a socket into non-blocking mode.
+ *
+ * @param socket The socket file descriptor.
+ * @return 0 on success, or -1 on failure.
+ */
+int set_nonblocking(int socket);
+
+/**
+ * @brief Send one length-prefixed frame, retrying partial writes.
+ *
+ * On a non-blocking socket, waits up to SEND_TIMEOUT_MS for buffer space.
+ *
+ * @param socket The socket file descriptor.
+ * @param data The payload to send.
+ * @param len The payload length in bytes.
+ * @return The payload length, or -1 on failure.
+ */
+int send_frame(int socket, const void* data, int len);
+
+/**
+ * @brief Send a text message as one frame.
  *
  * @param socket The socket file descriptor.
- * @param data The data string to send.
- * @return The number of bytes sent, or -1 on failure.
+ * @param data The data string to send, without its terminator.
+ * @return The number of payload bytes sent, or -1 on failure.
  */
 int send_data(int socket, const char* data);
 
 /**
- * @brief Receive data from a socket.
+ * @brief Allocate a per-connection receive buffer.
+ *
+ * @param frames The buffer to initialize.
+ * @param cap The capacity; bounds the largest acceptable frame.
+ * @return 0 on success, or -1 if allocation failed.
+ */
+int frame_buffer_init(FrameBuffer* frames, int cap);
+
+/**
+ * @brief Release a receive buffer.
+ *
+ * @param frames The buffer to free.
+ */
+void frame_buffer_free(FrameBuffer* frames);
+
+/**
+ * @brief Grow a receive buffer, keeping any bytes already buffered.
+ *
+ * @param frames The buffer to grow.
+ * @param cap The new capacity; ignored if not larger than the current one.
+ * @return 0 on success, or -1 if allocation failed.
+ */
+int frame_buffer_reserve(FrameBuffer* frames, int cap);
+
+/**
+ * @brief Read whatever the socket has into the receive buffer.
+ *
+ * Invalidates payload pointers returned by earlier next_frame() calls.
  *
  * @param socket The socket file descriptor.
- * @param buffer The buffer to store received data.
- * @param buffer_size The size of the buffer.
- * @return The number of bytes received, or -1 on failure.
+ * @param frames The connection's receive buffer.
+ * @return The number of bytes read, 0 on orderly shutdown, or -1 on failure
+ *         (errno is EAGAIN when a non-blocking socket had nothing to read).
+ */
+int receive_frames(int socket, FrameBuffer* frames);
+
+/**
+ * @brief Pop the next complete frame from the receive buffer.
+ *
+ * @param frames The connection's receive buffer.
+ * @param payload Set to the frame payload, valid until the next receive_frames().
+ * @param len Set to the payload length.
+ * @return 1 if a frame was returned, 0 if more bytes are needed, or -1 if
+ *         the peer announced a frame larger than the buffer.
+ */
+int next_frame(FrameBuffer* frames, const uint8_t** payload, int* len);
+
+/**
+ * @brief Allocate a frame buffer with one reference.
+ *
+ * The payload is written at data + FRAME_HEADER_SIZE, then out_buffer_seal().
+ *
+ * @param payload_cap The largest payload the buffer must hold.
+ * @param droppable Non-zero if a newer frame makes this one redundant.
+ * @return The buffer, or NULL if allocation failed.
+ */
+OutBuffer* out_buffer_alloc(int payload_cap, int droppable);
+
+/**
+ * @brief Write the frame header once the payload is in place.
+ *
+ * @param buffer The buffer to seal.
+ * @param payload_len The payload length in bytes.
+ */
+void out_buffer_seal(OutBuffer* buffer, int payload_len);
+
+/**
+ * @brief Copy a payload into a new sealed frame buffer.
+ *
+ * @param payload The payload bytes.
+ * @param len The payload length.
+ * @param droppable Non-zero if a newer frame makes this one redundant.
+ * @return The buffer with one reference, or NULL if allocation failed.
+ */
+OutBuffer* out_buffer_create(const void* payload, int len, int droppable);
+
+/**
+ * @brief Drop one reference, freeing the buffer with the last one.
+ *
+ * @param buffer The buffer to release.
+ */
+void out_buffer_release(OutBuffer* buffer);
+
+/**
+ * @brief Initialize an empty outbound queue.
+ *
+ * @param queue The queue to initialize.
+ */
+void out_queue_init(OutQueue* queue);
+
+/**
+ * @brief Release every queued buffer.
+ *
+ * @param queue The queue to empty.
+ */
+void out_queue_clear(OutQueue* queue);
+
+/**
+ * @brief Append a buffer, taking a new reference to it.
+ *
+ * @param queue The connection's outbound queue.
+ * @param buffer The frame to send.
+ * @return 0 on success, or -1 if the queue is full.
+ */
+int out_queue_push(OutQueue* queue, OutBuffer* buffer);
+
+/**
+ * @brief Drop every droppable frame that has not started going out.
+ *
+ * @param queue The connection's outbound queue.
+ * @return The number of frames dropped.
+ */
+int out_queue_collapse(OutQueue* queue);
+
+/**
+ * @brief Write as much of the queue as the socket accepts without blocking.
+ *
+ * @param socket A non-blocking socket.
+ * @param queue The connection's outbound queue.
+ * @return 1 if the queue drained, 0 if the socket is full, or -1 on failure.
+ */
+int out_queue_flush(int socket, OutQueue* queue);
+
+/**
+ * @brief Take the oldest frame off the queue.
+ *
+ * @param queue The connection's outbound queue.
+ * @return The frame, whose reference passes to the caller, or NULL if empty.
+ */
+OutBuffer* out_queue_pop(OutQueue* queue);
+
+/**
+ * @brief Reset a channel to its state before the first datagram.
+ *
+ * @param channel The channel to initialize.
+ */
+void channel_init(DatagramChannel* channel);
+
+/**
+ * @brief Drop every reliable message still waiting for an ack.
+ *
+ * @param channel The channel to empty.
+ */
+void channel_clear(DatagramChannel* channel);
+
+/**
+ * @brief Send one payload as a datagram.
+ *
+ * An unreliable payload that the socket cannot take is simply lost. A
+ * reliable one is copied and kept until acknowledged, so a failed send is
+ * made good by channel_resend().
+ *
+ * @param socket A UDP socket.
+ * @param peer The destination, or NULL if the socket is connected.
+ * @param channel The peer's channel.
+ * @param payload The payload bytes, at most DATAGRAM_MAX_PAYLOAD.
+ * @param len The payload length.
+ * @param reliable Non-zero to deliver in order and resend until acknowledged.
+ * @return 0 on success, or -1 if RELIABLE_WINDOW messages are already in flight.
+ */
+int channel_send(int socket, const struct sockaddr_in* peer, DatagramChannel* channel, const void* payload,
+                 int len, int reliable);
+
+/**
+ * @brief Resend unacknowledged reliable messages once they are overdue.
+ *
+ * @param socket A UDP socket.
+ * @param peer The destination, or NULL if the socket is connected.
+ * @param channel The peer's channel.
+ * @return 0 on success, or -1 if the peer stopped acknowledging.
+ */
+int channel_resend(int socket, const struct sockaddr_in* peer, DatagramChannel* channel);
+
+/**
+ * @brief Process one received datagram.
+ *
+ * Applies acks, acknowledges reliable messages and drops stale or
+ * duplicate ones.
+ *
+ * @param socket A UDP socket, used to send acks.
+ * @param peer The sender, or NULL if the socket is connected.
+ * @param channel The sender's channel.
+ * @param datagram The received bytes.
+ * @param len The number of received bytes.
+ * @param payload Set to the payload to deliver, pointing into datagram.
+ * @param payload_len Set to the payload length.
+ * @return 1 if a payload should be delivered, 0 if there is none, or -1 if
+ *         the peer disconnected.
+ */
+int channel_receive(int socket, const struct sockaddr_in* peer, DatagramChannel* channel, const uint8_t* datagram,
+                    int len, const uint8_t** payload, int* payload_len);
+
+/**
+ * @brief Tell the peer this side is going away.
+ *
+ * @param socket A UDP socket.
+ * @param peer The destination, or NULL if the socket is connected.
+ */
+void channel_disconnect(int socket, const struct sockaddr_in* peer);
+
+/**
+ * @brief Check whether a datagram opens a new connection.
+ *
+ * @param datagram The received bytes.
+ * @param len The number of received bytes.
+ * @return Non-zero if it is the first reliable message carrying DATAGRAM_CONNECT.
+ */
+int datagram_is_connect(const uint8_t* datagram, int len);
+
+/**
+ * @brief Receive one datagram.
+ *
+ * @param socket A UDP socket.
+ * @param buf The buffer to fill, DATAGRAM_MAX_SIZE bytes.
+ * @param from Set to the sender; may be NULL.
+ * @return The datagram length, or -1 on failure (errno is EAGAIN when a
+ *         non-blocking socket had nothing to read).
+ */
+int receive_datagram(int socket, uint8_t* buf, struct sockaddr_in* from);
+
+/**
+ * @brief Start encoding a snapshot into a caller-owned buffer.
+ *
+ * Sections must be written in wire order: player, bullet and ghost
+ * records grouped by kind, then removals.
+ *
+ * @param writer The writer to initialize.
+ * @param buf The output buffer.
+ * @param cap The capacity of the output buffer.
+ * @param tick The simulation tick the snapshot describes.
+ * @param base_tick The acknowledged tick this is a delta against, or 0 for a full snapshot.
+ * @param width The world width in cells.
+ * @param height The world height in cells.
+ */
+void snapshot_begin(SnapshotWriter* writer, uint8_t* buf, int cap, uint32_t tick, uint32_t base_tick, int width, int height);
+
+/**
+ * @brief Worst-case encoded size of a snapshot.
+ *
+ * Covers a full snapshot as well as a delta that removes every baseline
+ * entity and adds as many new ones.
+ *
+ * @param max_entities The most entities the world can hold at once.
+ * @return The size in bytes.
+ */
+int snapshot_max_size(int max_entities);
+
+/**
+ * @brief Append one entity record.
+ *
+ * @param writer The snapshot writer.
+ * @param record The entity to encode.
+ */
+void snapshot_add(SnapshotWriter* writer, const EntityRecord* record);
+
+/**
+ * @brief Append the changes between two sorted entity lists.
+ *
+ * Writes every record of current that is new or differs from base, then a
+ * removal for every entity of base missing from current.
+ *
+ * @param writer A writer started with a non-zero base_tick.
+ * @param base The baseline entities, sorted by (kind, id).
+ * @param base_count The number of baseline entities.
+ * @param current The current entities, sorted by (kind, id).
+ * @param current_count The number of current entities.
+ */
+void snapshot_write_delta(SnapshotWriter* writer, const EntityRecord* base, int base_count,
+                          const EntityRecord* current, int current_count);
+
+/**
+ * @brief Finalize the header counts.
+ *
+ * @param writer The snapshot writer.
+ * @return The encoded length in bytes, or -1 if the buffer overflowed.
+ */
+int snapshot_finish(SnapshotWriter* writer);
+
+/**
+ * @brief Validate a snapshot and map its sections without copying.
+ *
+ * @param buf The received bytes.
+ * @param len The number of received bytes.
+ * @param view The view to fill; it points into buf.
+ * @return 0 on success, or -1 if the snapshot is malformed.
+ */
+int snapshot_decode(const uint8_t* buf, int len, SnapshotView* view);
+
+/**
+ * @brief Read the record at index from a decoded snapshot.
+ *
+ * @param view The decoded snapshot.
+ * @param index Record index across all kinds, in wire order.
+ * @param record The record to fill.
+ */
+void snapshot_record(const SnapshotView* view, int index, EntityRecord* record);
+
+/**
+ * @brief Reconstruct the full sorted entity list a snapshot describes.
+ *
+ * @param view The decoded snapshot.
+ * @param base The entities at view->base_tick; ignored for full snapshots.
+ * @param base_count The number of baseline entities.
+ * @param out The list to fill, sorted by (kind, id).
+ * @param cap The capacity of out.
+ * @return The number of entities, or -1 if they do not fit in out.
+ */
+int snapshot_entities(const SnapshotView* view, const EntityRecord* base, int base_count, EntityRecord* out, int cap);
+
+/**
+ * @brief Rebuild a received snapshot into a client's history ring.
+ *
+ * A delta is applied to its baseline, which must still be in the ring.
+ *
+ * @param history The SNAPSHOT_HISTORY entries, each with max_entities records.
+ * @param max_entities The record capacity of each entry.
+ * @param view The decoded snapshot.
+ * @return The entry now holding view->tick, or NULL if the baseline is
+ *         missing or the snapshot does not fit.
+ */
+StoredSnapshot* snapshot_store(StoredSnapshot* history, int max_entities, const SnapshotView* view);
+
+/**
+ * @brief Size of a packed wall bitmap, one bit per cell, row-major.
+ *
+ * @param width The map width in cells.
+ * @param height The map height in cells.
+ * @return The size in bytes.
+ */
+int map_bitmap_size(int width, int height);
+
+/**
+ * @brief Test a cell of a packed wall bitmap.
+ *
+ * @param walls The bitmap.
+ * @param width The map width in cells.
+ * @param x The cell column.
+ * @param y The cell row.
+ * @return Non-zero if the cell is a wall.
+ */
+int map_wall(const uint8_t* walls, int width, int x, int y);
+
+/**
+ * @brief Encode one map tile.
+ *
+ * @param buf Receives MAP_TILE_SIZE bytes.
+ * @param cells Row-major cells, non-zero for walls.
+ * @param width The map width in cells.
+ * @param height The map height in cells.
+ * @param tile_x The tile column.
+ * @param tile_y The tile row.
+ * @return MAP_TILE_SIZE.
+ */
+int map_tile_encode(uint8_t* buf, const uint8_t* cells, int width, int height, int tile_x, int tile_y);
+
+/**
+ * @brief Copy a received map tile into a packed wall bitmap.
+ *
+ * @param buf The received bytes.
+ * @param len The number of received bytes.
+ * @param walls The bitmap to update, sized by map_bitmap_size().
+ * @param width The map width in cells.
+ * @param height The map height in cells.
+ * @param tile_x Receives the tile column.
+ * @param tile_y Receives the tile row.
+ * @return 0 on success, or -1 if the tile is malformed or off the map.
+ */
+int map_tile_decode(const uint8_t* buf, int len, uint8_t* walls, int width, int height, int* tile_x, int* tile_y);
+
+/**
+ * @brief Identify and decode a text message in one pass.
+ *
+ * Nothing is copied or allocated, so a frame or datagram payload can be
+ * parsed where it lies.
+ *
+ * @param text The message; it need not be NUL-terminated.
+ * @param len The message length in bytes.
+ * @param message Filled with the type and fields.
+ * @return 0 on success, or -1 if the message is unknown or malformed.
+ */
+int message_parse(const uint8_t* text, int len, Message* message);
+
+/**
+ * @brief Read the limits from a parsed ASSIGN_ID message.
+ *
+ * @param message A MESSAGE_ASSIGN_ID message.
+ * @param handshake The limits to fill.
+ * @return 0 on success, or -1 if a limit is out of range.
  */
-int receive_data(int socket, char* buffer, int buffer_size);
+int handshake_parse(const Message* message, Handshake* handshake);
 
 #endif // SOCK_H
@@ -0,0 +1,602 @@
+#include "world.h"
+#include "kernels.h"
+#include "profile.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Every world array is carved from one block. With base == NULL this only
+// measures, so the same code computes the arena size and lays it out.
+typedef struct {
+    uint8_t* base;
+    size_t used;
+} Arena;
+
+static void* arena_take(Arena* arena, size_t size) {
+    size_t offset = (arena->used + 15) & ~(size_t)15;
+    arena->used = offset + size;
+    return arena->base != NULL ? arena->base + offset : NULL;
+}
+
+static void layout_world(World* world, Arena* arena) {
+    const WorldConfig* config = &world->config;
+    int players = config->max_players;
+    int ghosts = config->max_ghosts;
+    int bullets = world->max_bullets;
+    size_t cells = (size_t)config->width * config->height;
+
+    PlayerTable* p = &world->players;
+    p->x = arena_take(arena, players * sizeof(int32_t));
+    p->y = arena_take(arena, players * sizeof(int32_t));
+    p->active = arena_take(arena, players * sizeof(uint8_t));
+    p->id = arena_take(arena, players * sizeof(int32_t));
+    p->start_tick = arena_take(arena, players * sizeof(uint32_t));
+    p->bullet_count = arena_take(arena, players * sizeof(int32_t));
+    p->next_fire_tick = arena_take(arena, players * sizeof(uint32_t));
+    p->move_seq = arena_take(arena, players * sizeof(uint16_t));
+
+    GhostTable* g = &world->ghosts;
+    g->x = arena_take(arena, ghosts * sizeof(int32_t));
+    g->y = arena_take(arena, ghosts * sizeof(int32_t));
+    g->id = arena_take(arena, ghosts * sizeof(int32_t));
+    g->index_of = arena_take(arena, ghosts * sizeof(int32_t));
+    g->free_ids = arena_take(arena, ghosts * sizeof(int32_t));
+
+    BulletTable* b = &world->bullets;
+    b->x = arena_take(arena, bullets * sizeof(int32_t));
+    b->y = arena_take(arena, bullets * sizeof(int32_t));
+    b->dx = arena_take(arena, bullets * sizeof(int32_t));
+    b->dy = arena_take(arena, bullets * sizeof(int32_t));
+    b->direction = arena_take(arena, bullets * sizeof(uint8_t));
+    b->owner = arena_take(arena, bullets * sizeof(int32_t));
+    b->id = arena_take(arena, bullets * sizeof(int32_t));
+    b->index_of = arena_take(arena, bullets * sizeof(int32_t));
+    b->free_ids = arena_take(arena, bullets * sizeof(int32_t));
+    world->step_cells = arena_take(arena, bullets * sizeof(int32_t));
+
+    world->events = arena_take(arena, players * sizeof(WorldEvent));
+    world->generated = config->map == NULL ? arena_take(arena, cells) : NULL;
+    world->grid = config->map != NULL ? config->map->cells : world->generated;
+    world->distance = arena_take(arena, cells * sizeof(uint32_t));
+    world->frontier = arena_take(arena, cells * sizeof(uint32_t));
+    world->cell_first = arena_take(arena, cells * sizeof(int32_t));
+    world->occupant_next = arena_take(arena, world->max_entities * sizeof(int32_t));
+    world->occupant_prev = arena_take(arena, world->max_entities * sizeof(int32_t));
+    world->occupant_cell = arena_take(arena, world->max_entities * sizeof(int32_t));
+    for (int i = 0; i < SNAPSHOT_HISTORY; i++) {
+        world->history[i].entities = arena_take(arena, world->max_entities * sizeof(EntityRecord));
+    }
+}
+
+int world_max_entities(const WorldConfig* config) {
+    return config->max_players * (1 + config->bullets_per_player) + config->max_ghosts;
+}
+
+int world_config_validate(const WorldConfig* config) {
+    if (config->width <= 0 || config->height <= 0 || config->max_players <= 0 || config->max_ghosts < 0 ||
+        config->bullets_per_player < 0 || config->fire_cooldown < 0) {
+        return -1;
+    }
+    if (config->width > MAX_GRID_SIDE || config->height > MAX_GRID_SIDE ||
+        (long)config->width * config->height > MAX_GRID_CELLS) {
+        return -1;
+    }
+    if ((long)config->max_players * (1 + config->bullets_per_player) + config->max_ghosts > MAX_WORLD_ENTITIES) {
+        return -1;
+    }
+    if (config->map != NULL && (config->map->width != config->width || config->map->height != config->height)) {
+        return -1;
+    }
+    return 0;
+}
+
+int world_create(World* world, const WorldConfig* config) {
+    memset(world, 0, sizeof(*world));
+    world->config = *config;
+    world->max_bullets = config->max_players * config->bullets_per_player;
+    world->max_entities = world_max_entities(config);
+
+    Arena arena = {NULL, 0};
+    layout_world(world, &arena);
+    world->arena_size = arena.used;
+    world->arena = malloc(world->arena_size);
+    if (world->arena == NULL) {
+        return -1;
+    }
+
+    arena.base = world->arena;
+    arena.used = 0;
+    layout_world(world, &arena);
+    return 0;
+}
+
+void world_destroy(World* world) {
+    free(world->arena);
+    world->arena = NULL;
+}
+
+// xorshift64*, seeded through splitmix64 so that any seed, 0 included,
+// gives a well-mixed non-zero state.
+static void seed_random(World* world, uint64_t seed) {
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    z ^= z >> 31;
+    world->random_state = z != 0 ? z : 1;
+}
+
+static uint32_t next_random(World* world) {
+    uint64_t x = world->random_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    world->random_state = x;
+    return (uint32_t)((x * 0x2545F4914F6CDD1Dull) >> 32);
+}
+
+void world_init(World* world, uint64_t seed) {
+    const WorldConfig* config = &world->config;
+    memset(world->arena, 0, world->arena_size);
+    // -1 is all ones: every cell starts empty, no entity is placed and no
+    // id is in use.
+    memset(world->cell_first, 0xFF, (size_t)config->width * config->height * sizeof(int32_t));
+    memset(world->occupant_cell, 0xFF, world->max_entities * sizeof(int32_t));
+    memset(world->ghosts.index_of, 0xFF, config->max_ghosts * sizeof(int32_t));
+    memset(world->bullets.index_of, 0xFF, world->max_bullets * sizeof(int32_t));
+
+    // Hand out low ids first.
+    world->ghosts.count = 0;
+    world->ghosts.free_count = config->max_ghosts;
+    for (int i = 0; i < config->max_ghosts; i++) {
+        world->ghosts.free_ids[i] = config->max_ghosts - 1 - i;
+    }
+    world->bullets.count = 0;
+    world->bullets.free_count = world->max_bullets;
+    for (int i = 0; i < world->max_bullets; i++) {
+        world->bullets.free_ids[i] = world->max_bullets - 1 - i;
+    }
+
+    world->tick = 0;
+    world->event_count = 0;
+    seed_random(world, seed);
+    for (int i = 0; i < SNAPSHOT_HISTORY; i++) {
+        world->history[i].tick = 0;
+        world->history[i].count = 0;
+    }
+    // The flow field's scratch is free until the first world_step().
+    if (world->generated != NULL) {
+        map_generate(world->generated, config->width, config->height, seed, 1, world->distance, world->frontier);
+    }
+}
+
+// Entities share one index space in the occupancy lists: players by slot,
+// then bullets and ghosts by id.
+static int player_entity(const World* world, int slot) {
+    (void)world;
+    return slot;
+}
+
+static int bullet_entity(const World* world, int id) {
+    return world->config.max_players + id;
+}
+
+static int ghost_entity(const World* world, int id) {
+    return world->config.max_players + world->max_bullets + id;
+}
+
+static void occupancy_remove(World* world, int entity) {
+    int cell = world->occupant_cell[entity];
+    if (cell < 0) {
+        return;
+    }
+    int next = world->occupant_next[entity];
+    int prev = world->occupant_prev[entity];
+    if (prev >= 0) {
+        world->occupant_next[prev] = next;
+    } else {
+        world->cell_first[cell] = next;
+    }
+    if (next >= 0) {
+        world->occupant_prev[next] = prev;
+    }
+    world->occupant_cell[entity] = -1;
+}
+
+static void occupancy_place(World* world, int entity, int x, int y) {
+    int cell = y * world->config.width + x;
+    if (world->occupant_cell[entity] == cell) {
+        return;
+    }
+    occupancy_remove(world, entity);
+
+    int first = world->cell_first[cell];
+    world->occupant_next[entity] = first;
+    world->occupant_prev[entity] = -1;
+    if (first >= 0) {
+        world->occupant_prev[first] = entity;
+    }
+    world->cell_first[cell] = entity;
+    world->occupant_cell[entity] = cell;
+}
+
+// First entity in [first, last) standing on (x, y), or -1.
+static int occupant(const World* world, int x, int y, int first, int last) {
+    int entity = world->cell_first[y * world->config.width + x];
+    while (entity >= 0 && (entity < first || entity >= last)) {
+        entity = world->occupant_next[entity];
+    }
+    return entity;
+}
+
+static void remove_bullet(World* world, int index) {
+    BulletTable* b = &world->bullets;
+    occupancy_remove(world, bullet_entity(world, b->id[index]));
+    b->index_of[b->id[index]] = -1;
+    b->free_ids[b->free_count++] = b->id[index];
+    world->players.bullet_count[b->owner[index]]--;
+
+    int last = --b->count;
+    if (index != last) {
+        b->x[index] = b->x[last];
+        b->y[index] = b->y[last];
+        b->dx[index] = b->dx[last];
+        b->dy[index] = b->dy[last];
+        b->direction[index] = b->direction[last];
+        b->owner[index] = b->owner[last];
+        b->id[index] = b->id[last];
+        world->step_cells[index] = world->step_cells[last];
+        b->index_of[b->id[index]] = index;
+    }
+}
+
+static void remove_ghost(World* world, int index) {
+    GhostTable* g = &world->ghosts;
+    occupancy_remove(world, ghost_entity(world, g->id[index]));
+    g->index_of[g->id[index]] = -1;
+    g->free_ids[g->free_count++] = g->id[index];
+
+    int last = --g->count;
+    if (index != last) {
+        g->x[index] = g->x[last];
+        g->y[index] = g->y[last];
+        g->id[index] = g->id[last];
+        g->index_of[g->id[index]] = index;
+    }
+}
+
+void world_add_player(World* world, int slot, int id) {
+    PlayerTable* p = &world->players;
+    p->id[slot] = id;
+    p->active[slot] = 1;
+    p->start_tick[slot] = world->tick;
+    p->move_seq[slot] = 0;
+
+    int width = world->config.width;
+    do {
+        p->x[slot] = next_random(world) % width;
+        p->y[slot] = next_random(world) % world->config.height;
+    } while (world->grid[p->y[slot] * width + p->x[slot]] != 0);
+    occupancy_place(world, player_entity(world, slot), p->x[slot], p->y[slot]);
+}
+
+void world_remove_player(World* world, int slot) {
+    world->players.active[slot] = 0;
+    occupancy_remove(world, player_entity(world, slot));
+
+    // Whoever takes the slot next starts with no bullets of their own.
+    BulletTable* b = &world->bullets;
+    int i = 0;
+    while (i < b->count) {
+        if (b->owner[i] == slot) {
+            remove_bullet(world, i);
+        } else {
+            i++;
+        }
+    }
+    world->players.next_fire_tick[slot] = 0;
+}
+
+void world_apply_input(World* world, const Input* input) {
+    PlayerTable* p = &world->players;
+    int slot = input->player_slot;
+    if (!p->active[slot]) {
+        return;
+    }
+
+    if (input->type == INPUT_MOVE) {
+        int dx = 0, dy = 0;
+        switch (input->direction) {
+            case 'W': dy = -1; break;
+            case 'S': dy = 1; break;
+            case 'A': dx = -1; break;
+            case 'D': dx = 1; break;
+        }
+        p->move_seq[slot] = input->seq;
+
+        // One cell at a time, so the first wall or edge ends the move.
+        int x = p->x[slot], y = p->y[slot];
+        for (int i = 0; i < input->steps && (dx != 0 || dy != 0); i++) {
+            int new_x = x + dx, new_y = y + dy;
+            if (new_x < 0 || new_x >= world->config.width || new_y < 0 || new_y >= world->config.height ||
+                world->grid[new_y * world->config.width + new_x] != 0) {
+                break;
+            }
+            x = new_x;
+            y = new_y;
+        }
+        if (x != p->x[slot] || y != p->y[slot]) {
+            p->x[slot] = x;
+            p->y[slot] = y;
+            occupancy_place(world, player_entity(world, slot), x, y);
+        }
+    } else if (input->type == INPUT_SHOOT) {
+        int dx = 0, dy = 0;
+        switch (input->direction) {
+            case 'U': dy = -1; break;
+            case 'D': dy = 1; break;
+            case 'L': dx = -1; break;
+            case 'R': dx = 1; break;
+            default: return;  // a bullet that never moves would kill its shooter
+        }
+
+        BulletTable* b = &world->bullets;
+        if (world->tick < p->next_fire_tick[slot] || p->bullet_count[slot] >= world->config.bullets_per_player ||
+            b->free_count == 0) {
+            return;
+        }
+        p->next_fire_tick[slot] = world->tick + world->config.fire_cooldown;
+        p->bullet_count[slot]++;
+
+        int index = b->count++;
+        int id = b->free_ids[--b->free_count];
+        b->id[index] = id;
+        b->index_of[id] = index;
+        b->owner[index] = slot;
+        b->x[index] = p->x[slot];
+        b->y[index] = p->y[slot];
+        b->dx[index] = dx;
+        b->dy[index] = dy;
+        b->direction[index] = (uint8_t)input->direction;
+        occupancy_place(world, bullet_entity(world, id), b->x[index], b->y[index]);
+    }
+}
+
+static void kill_player(World* world, int slot, WorldEventType type) {
+    world->players.active[slot] = 0;
+    occupancy_remove(world, player_entity(world, slot));
+
+    WorldEvent* event = &world->events[world->event_count++];
+    event->type = type;
+    event->player_slot = slot;
+    event->survival_ticks = world->tick - world->players.start_tick[slot];
+}
+
+static void step_bullets(World* world) {
+    const WorldConfig* config = &world->config;
+    BulletTable* b = &world->bullets;
+    GhostTable* g = &world->ghosts;
+    int first_ghost = ghost_entity(world, 0);
+
+    // Positions and bounds for every bullet at once; walls and hits below.
+    kernel_advance(b->x, b->y, b->dx, b->dy, b->count, config->width, config->height, world->step_cells);
+
+    int i = 0;
+    while (i < b->count) {
+        int cell = world->step_cells[i];
+        int new_x = b->x[i] + b->dx[i];
+        int new_y = b->y[i] + b->dy[i];
+        int spent = cell < 0 || world->grid[cell] == 1;
+
+        if (!spent) {
+            int player = occupant(world, new_x, new_y, 0, config->max_players);
+            if (player >= 0) {
+                spent = 1;
+                printf("Player %d was hit by a bullet!\n", world->players.id[player]);
+                kill_player(world, player, EVENT_PLAYER_HIT);
+            }
+            int ghost = occupant(world, new_x, new_y, first_ghost, world->max_entities);
+            if (ghost >= 0) {
+                spent = 1;
+                remove_ghost(world, g->index_of[ghost - first_ghost]);
+                printf("Ghost at (%d, %d) was killed by a bullet!\n", new_x, new_y);
+            }
+        }
+
+        if (spent) {
+            // Moves the last bullet into slot i, which is checked next.
+            remove_bullet(world, i);
+        } else {
+            b->x[i] = new_x;
+            b->y[i] = new_y;
+            occupancy_place(world, bullet_entity(world, b->id[i]), new_x, new_y);
+            i++;
+        }
+    }
+}
+
+// Multi-source BFS from every active player over free cells. Afterwards
+// distance[cell] is the number of steps to the nearest player, or
+// FLOW_UNREACHABLE, and a ghost only has to look at its four neighbours.
+static void build_flow_field(World* world) {
+    int width = world->config.width;
+    int cells = width * world->config.height;
+    uint32_t* distance = world->distance;
+    uint32_t* frontier = world->frontier;
+    int head = 0, tail = 0;
+
+    // FLOW_UNREACHABLE is all ones.
+    memset(distance, 0xFF, (size_t)cells * sizeof(uint32_t));
+    const PlayerTable* p = &world->players;
+    for (int i = 0; i < world->config.max_players; i++) {
+        int c = p->y[i] * width + p->x[i];
+        if (p->active[i] && distance[c] != 0) {
+            distance[c] = 0;
+            frontier[tail++] = c;
+        }
+    }
+
+    while (head < tail) {
+        int c = frontier[head++];
+        int x = c % width;
+        uint32_t next = distance[c] + 1;
+        int neighbours[4] = {
+            c >= width ? c - width : -1,
+            c + width < cells ? c + width : -1,
+            x > 0 ? c - 1 : -1,
+            x < width - 1 ? c + 1 : -1,
+        };
+        for (int k = 0; k < 4; k++) {
+            int n = neighbours[k];
+            if (n >= 0 && world->grid[n] == 0 && distance[n] == FLOW_UNREACHABLE) {
+                distance[n] = next;
+                frontier[tail++] = n;
+            }
+        }
+    }
+}
+
+static void spawn_ghost(World* world) {
+    const WorldConfig* config = &world->config;
+    GhostTable* g = &world->ghosts;
+    if (g->free_count == 0) {
+        return;
+    }
+
+    int x, y;
+    if (next_random(world) % 2 == 0) {
+        x = (next_random(world) % 2) * (config->width - 1);
+        y = next_random(world) % config->height;
+    } else {
+        x = next_random(world) % config->width;
+        y = (next_random(world) % 2) * (config->height - 1);
+    }
+    // Ghosts never stand in walls; try again next ghost step.
+    if (world->grid[y * config->width + x] != 0) {
+        return;
+    }
+
+    int index = g->count++;
+    int id = g->free_ids[--g->free_count];
+    g->x[index] = x;
+    g->y[index] = y;
+    g->id[index] = id;
+    g->index_of[id] = index;
+    occupancy_place(world, ghost_entity(world, id), x, y);
+}
+
+static void step_ghosts(World* world) {
+    const WorldConfig* config = &world->config;
+    GhostTable* g = &world->ghosts;
+
+    if (next_random(world) % 100 < 20) {
+        spawn_ghost(world);
+    }
+
+    build_flow_field(world);
+    kernel_ghost_steps(g->x, g->y, g->count, config->width, config->height, world->distance);
+
+    for (int i = 0; i < g->count; i++) {
+        occupancy_place(world, ghost_entity(world, g->id[i]), g->x[i], g->y[i]);
+
+        if (world->distance[g->y[i] * config->width + g->x[i]] == 0) {
+            int player;
+            while ((player = occupant(world, g->x[i], g->y[i], 0, config->max_players)) >= 0) {
+                printf("Player %d was caught by a ghost!\n", world->players.id[player]);
+                kill_player(world, player, EVENT_PLAYER_CAUGHT);
+            }
+        }
+    }
+}
+
+void world_step(World* world, int ghost_interval) {
+    world->tick++;
+    world->event_count = 0;
+    long start = clock_ns();
+    step_bullets(world);
+    long bullets_done = clock_ns();
+    world->bullets_ns = bullets_done - start;
+    world->ghosts_ns = 0;
+    if (world->tick % ghost_interval == 0) {
+        step_ghosts(world);
+        world->ghosts_ns = clock_ns() - bullets_done;
+    }
+}
+
+StoredSnapshot* world_record(World* world) {
+    const PlayerTable* p = &world->players;
+    const BulletTable* b = &world->bullets;
+    const GhostTable* g = &world->ghosts;
+    StoredSnapshot* snapshot = &world->history[world->tick % SNAPSHOT_HISTORY];
+    snapshot->tick = world->tick;
+    snapshot->count = 0;
+
+    for (int i = 0; i < world->config.max_players; i++) {
+        if (p->active[i]) {
+            EntityRecord record = {ENTITY_PLAYER, 0, p->id[i], p->x[i], p->y[i], p->move_seq[i]};
+            snapshot->entities[snapshot->count++] = record;
+        }
+    }
+
+    // Tables are packed in no particular order; walk ids to keep records
+    // sorted.
+    for (int id = 0; id < world->max_bullets; id++) {
+        int i = b->index_of[id];
+        if (i >= 0) {
+            EntityRecord record = {ENTITY_BULLET, b->direction[i], id, b->x[i], b->y[i], p->id[b->owner[i]]};
+            snapshot->entities[snapshot->count++] = record;
+        }
+    }
+
+    for (int id = 0; id < world->config.max_ghosts; id++) {
+        int i = g->index_of[id];
+        if (i >= 0) {
+            EntityRecord record = {ENTITY_GHOST, 0, id, g->x[i], g->y[i], 0};
+            snapshot->entities[snapshot->count++] = record;
+        }
+    }
+    return snapshot;
+}
+
+StoredSnapshot* world_snapshot(World* world, uint32_t tick) {
+    if (tick == 0) {
+        return NULL;
+    }
+    StoredSnapshot* snapshot = &world->history[tick % SNAPSHOT_HISTORY];
+    return snapshot->tick == tick ? snapshot : NULL;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const void* data, size_t size) {
+    const uint8_t* bytes = data;
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+
+uint64_t world_checksum(const World* world) {
+    const PlayerTable* p = &world->players;
+    const GhostTable* g = &world->ghosts;
+    const BulletTable* b = &world->bullets;
+    int players = world->config.max_players;
+
+    uint64_t hash = 0xCBF29CE484222325ull;
+    hash = hash_bytes(hash, &world->tick, sizeof(world->tick));
+    hash = hash_bytes(hash, &world->random_state, sizeof(world->random_state));
+    hash = hash_bytes(hash, p->x, players * sizeof(int32_t));
+    hash = hash_bytes(hash, p->y, players * sizeof(int32_t));
+    hash = hash_bytes(hash, p->active, players * sizeof(uint8_t));
+    hash = hash_bytes(hash, p->bullet_count, players * sizeof(int32_t));
+    hash = hash_bytes(hash, p->next_fire_tick, players * sizeof(uint32_t));
+    hash = hash_bytes(hash, p->move_seq, players * sizeof(uint16_t));
+    hash = hash_bytes(hash, &g->count, sizeof(g->count));
+    hash = hash_bytes(hash, g->x, g->count * sizeof(int32_t));
+    hash = hash_bytes(hash, g->y, g->count * sizeof(int32_t));
+    hash = hash_bytes(hash, g->id, g->count * sizeof(int32_t));
+    hash = hash_bytes(hash, &b->count, sizeof(b->count));
+    hash = hash_bytes(hash, b->x, b->count * sizeof(int32_t));
+    hash = hash_bytes(hash, b->y, b->count * sizeof(int32_t));
+    hash = hash_bytes(hash, b->direction, b->count * sizeof(uint8_t));
+    hash = hash_bytes(hash, b->owner, b->count * sizeof(int32_t));
+    hash = hash_bytes(hash, b->id, b->count * sizeof(int32_t));
+    return hash;
+}
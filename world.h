@@ -0,0 +1,250 @@
+#ifndef WORLD_H
+#define WORLD_H
+
+#include "map.h"
+#include "sock.h"
+#include <stddef.h>
+
+#define DEFAULT_GRID_WIDTH 30
+#define DEFAULT_GRID_HEIGHT 30
+#define DEFAULT_MAX_PLAYERS 4
+#define DEFAULT_MAX_GHOSTS 10
+#define DEFAULT_BULLETS_PER_PLAYER 4
+#define DEFAULT_FIRE_COOLDOWN 2
+
+// Snapshot coordinates, ids and per-kind counts are 16-bit.
+#define MAX_GRID_SIDE 65535
+#define MAX_GRID_CELLS (1 << 24)
+#define MAX_WORLD_ENTITIES 65535
+
+// Flow field value for cells no player can be reached from.
+#define FLOW_UNREACHABLE UINT32_MAX
+
+typedef struct {
+    int width;
+    int height;
+    int max_players;
+    int max_ghosts;
+    int bullets_per_player;  // live bullets one player may have
+    int fire_cooldown;       // ticks between shots by one player
+    const Map* map;          // shared wall layout, or NULL to generate one per world
+} WorldConfig;
+
+// Entity state is kept as parallel columns (structure of arrays) so the
+// per-tick kernels stream through contiguous memory.
+
+// Players stay in their slot for as long as they are connected.
+typedef struct {
+    int32_t* x;
+    int32_t* y;
+    uint8_t* active;
+    int32_t* id;
+    uint32_t* start_tick;     // tick the player joined
+    int32_t* bullet_count;    // live bullets fired by this slot
+    uint32_t* next_fire_tick;  // earliest tick the slot may fire again
+    uint16_t* move_seq;        // seq of the last MOVE applied, echoed to the client
+} PlayerTable;
+
+// Live ghosts are packed into [0, count); removing one moves the last
+// into its place. Ids stay with the ghost and are what clients see.
+typedef struct {
+    int count;
+    int32_t* x;
+    int32_t* y;
+    int32_t* id;
+    int32_t* index_of;  // max_ghosts, id -> index or -1
+    int32_t* free_ids;  // stack of unused ids
+    int free_count;
+} GhostTable;
+
+// Fixed-capacity bullet pool, packed like ghosts, with ids from a free
+// stack so firing and expiring are O(1).
+typedef struct {
+    int count;
+    int32_t* x;
+    int32_t* y;
+    int32_t* dx;
+    int32_t* dy;
+    uint8_t* direction;  // 'U', 'D', 'L' or 'R'
+    int32_t* owner;      // player slot that fired it
+    int32_t* id;
+    int32_t* index_of;   // max_bullets, id -> index or -1
+    int32_t* free_ids;   // stack of unused ids
+    int free_count;
+} BulletTable;
+
+typedef enum {
+    INPUT_MOVE,
+    INPUT_SHOOT
+} InputType;
+
+typedef struct {
+    int player_slot;
+    InputType type;
+    int steps;
+    char direction;
+    uint16_t seq;  // MOVE only: client sequence number, 0 if untagged
+} Input;
+
+typedef enum {
+    EVENT_PLAYER_HIT,
+    EVENT_PLAYER_CAUGHT
+} WorldEventType;
+
+typedef struct {
+    WorldEventType type;
+    int player_slot;
+    uint32_t survival_ticks;
+} WorldEvent;
+
+// One independent match. Nothing in here is shared between worlds; every
+// array points into a single arena allocated by world_create().
+typedef struct {
+    WorldConfig config;
+    int max_bullets;   // max_players * bullets_per_player
+    int max_entities;  // players + bullets + ghosts
+    uint32_t tick;
+    uint64_t random_state;  // every random choice the world makes comes from here
+    PlayerTable players;  // max_players
+    GhostTable ghosts;    // max_ghosts
+    BulletTable bullets;  // max_bullets
+    int32_t* step_cells;  // max_bullets, scratch for kernel_advance()
+    const uint8_t* grid;  // width * height, row-major, 1 for walls
+    uint8_t* generated;   // width * height, where world_init() builds walls; NULL with a map
+    uint32_t* distance;  // width * height, ghost flow field
+    uint32_t* frontier;  // width * height, BFS queue for the flow field
+    // Per-cell occupancy lists, updated whenever an entity moves. Entities
+    // are numbered players, bullets, ghosts; -1 ends a list.
+    int32_t* cell_first;     // width * height, first entity on each cell
+    int32_t* occupant_next;  // max_entities
+    int32_t* occupant_prev;  // max_entities
+    int32_t* occupant_cell;  // max_entities, -1 while not placed
+    WorldEvent* events;  // max_players
+    int event_count;
+    long bullets_ns;  // time the last world_step() spent on bullets
+    long ghosts_ns;   // and on ghosts, 0 if they did not move
+    StoredSnapshot history[SNAPSHOT_HISTORY];
+    void* arena;
+    size_t arena_size;
+} World;
+
+/**
+ * @brief Check that a configuration fits the snapshot format and its map.
+ *
+ * @param config The configuration to check.
+ * @return 0 if it is usable, or -1 otherwise.
+ */
+int world_config_validate(const WorldConfig* config);
+
+/**
+ * @brief Count the entities a world can hold at once.
+ *
+ * @param config The world configuration.
+ * @return Players plus the bullet pool plus ghosts.
+ */
+int world_max_entities(const WorldConfig* config);
+
+/**
+ * @brief Allocate the arena backing a world.
+ *
+ * @param world The world to set up.
+ * @param config Its dimensions and entity caps.
+ * @return 0 on success, or -1 if allocation failed.
+ */
+int world_create(World* world, const WorldConfig* config);
+
+/**
+ * @brief Release a world's arena.
+ *
+ * @param world The world to free.
+ */
+void world_destroy(World* world);
+
+/**
+ * @brief Reset a world to tick 0.
+ *
+ * Without a shared map the walls are regenerated from the seed. Reuses
+ * the arena; nothing is allocated. The same seed followed by the same
+ * calls yields the same world.
+ *
+ * @param world The world to reset, set up by world_create().
+ * @param seed Seed for the world's random number generator.
+ */
+void world_init(World* world, uint64_t seed);
+
+/**
+ * @brief Spawn a player on a random free cell.
+ *
+ * @param world The world.
+ * @param slot The player slot, below config.max_players.
+ * @param id The player id sent to clients.
+ */
+void world_add_player(World* world, int slot, int id);
+
+/**
+ * @brief Remove a player from the world.
+ *
+ * @param world The world.
+ * @param slot The player slot.
+ */
+void world_remove_player(World* world, int slot);
+
+/**
+ * @brief Apply one queued MOVE or SHOOT input.
+ *
+ * A MOVE walks up to steps cells and stops short at the first wall or
+ * edge. It records its seq whether or not the player moved, so the client
+ * knows which of its predicted moves the server has processed.
+ *
+ * A shot is dropped if its direction is not 'U', 'D', 'L' or 'R', the
+ * player is still cooling down, already has bullets_per_player bullets in
+ * flight, or the pool is empty.
+ *
+ * @param world The world.
+ * @param input The input to apply; ignored if its player is not active.
+ */
+void world_apply_input(World* world, const Input* input);
+
+/**
+ * @brief Advance the world by one tick.
+ *
+ * Bullets move every tick and ghosts every ghost_interval ticks, following
+ * a flow field around walls towards the nearest player. Deaths are
+ * reported in world->events, which is cleared at the start of each step.
+ * The time spent on each is kept in bullets_ns and ghosts_ns.
+ *
+ * @param world The world.
+ * @param ghost_interval Ticks between ghost steps.
+ */
+void world_step(World* world, int ghost_interval);
+
+/**
+ * @brief Capture the current entities, sorted by (kind, id), into the
+ * history ring.
+ *
+ * @param world The world.
+ * @return The snapshot for world->tick.
+ */
+StoredSnapshot* world_record(World* world);
+
+/**
+ * @brief Look up a recorded snapshot to use as a delta baseline.
+ *
+ * @param world The world.
+ * @param tick The tick to find.
+ * @return The snapshot, or NULL if tick is 0 or has left the history ring.
+ */
+StoredSnapshot* world_snapshot(World* world, uint32_t tick);
+
+/**
+ * @brief Hash the state that later ticks depend on.
+ *
+ * Covers the tick, the random state and every live entity. Walls are
+ * left out since they never change after world_init().
+ *
+ * @param world The world.
+ * @return A 64-bit FNV-1a hash.
+ */
+uint64_t world_checksum(const World* world);
+
+#endif // WORLD_H